@@ -1,25 +1,76 @@
 /**
  *  @file
  *  @copyright defined in eos/LICENSE.txt
+ *
+ *  Build with -DBRM_SINGLE_TOKEN for deployments that only ever carry
+ *  BRM,3: symbol checks then compare against BRM_SYMBOL at compile time
+ *  and stats is only read by create/issue/retire/open.
+ *
+ *  -DBRM_NO_STAKING and -DBRM_NO_INVOICES leave the staking and the
+ *  invoicing actions, tables and dispatch entries out of the module, so
+ *  a transfer-only deployment does not load code it never runs. Both
+ *  together give the plain token; the ABI has to be generated from the
+ *  same flags. Module size per variant:
+ *
+ *     for f in "" -DBRM_NO_INVOICES -DBRM_NO_STAKING "-DBRM_NO_STAKING -DBRM_NO_INVOICES"; do
+ *        eosio-cpp -O=z $f -I include -o eosio.token.wasm src/eosio.token.cpp &&
+ *        echo "${f:-full}: $(wc -c < eosio.token.wasm) bytes"
+ *     done
  */
 #pragma once
 
 #include <eosiolib/asset.hpp>
 #include <eosiolib/eosio.hpp>
+#ifndef BRM_NO_INVOICES
 #include <eosiolib/crypto.h>
+#endif
+#include <eosiolib/singleton.hpp>
 #include <eosiolib/time.hpp>
-#include <eosiolib/transaction.hpp>
 
 
+#include <limits>
 #include <string>
+#include <string_view>
 
 namespace eosiosystem {
    class system_contract;
 }
 
+namespace brm_reconcile {
+   struct rows;
+}
+
 namespace eosio {
 
    using std::string;
+   using std::vector;
+
+   struct transfer_entry {
+      name     to;
+      asset    quantity;
+      string   memo;
+   };
+
+   struct issue_entry {
+      name     to;
+      asset    quantity;
+   };
+
+#ifndef BRM_NO_STAKING
+   // one entry of the getpositions output
+   struct account_position {
+      name     owner;
+      asset    balance;
+      asset    staked;
+      uint8_t  stake_period;
+      uint32_t stake_due;
+      asset    locked;
+      uint32_t refund_due;
+      asset    pending_reward;
+
+      EOSLIB_SERIALIZE( account_position, (owner)(balance)(staked)(stake_period)(stake_due)(locked)(refund_due)(pending_reward) )
+   };
+#endif
 
    class [[eosio::contract("eosio.token")]] token : public contract {
       public:
@@ -32,6 +83,14 @@ namespace eosio {
          [[eosio::action]]
          void issue( name to, asset quantity, string memo );
 
+         /**
+          * Issues to many recipients at once: supply is updated once for the
+          * batch total and recipients are credited directly, new balance rows
+          * are paid for by ram_payer. Duplicate recipients are merged.
+          */
+         [[eosio::action]]
+         void issuemany( const symbol& sym, name ram_payer, const vector<issue_entry>& issues );
+
          [[eosio::action]]
          void retire( asset quantity, string memo );
 
@@ -41,12 +100,44 @@ namespace eosio {
                         asset   quantity,
                         string  memo );
 
+         /**
+          * Compact transfer of BRM for high-frequency payments: no symbol
+          * and no memo on the wire and the amount (raw BRM units) as a
+          * varuint32. Larger amounts need transfer.
+          *
+          * from and to are notified with this transferc action, not with a
+          * transfer, so "*::transfer" notification handlers and indexers
+          * that only follow transfer do not see these payments.
+          */
+         [[eosio::action]]
+         void transferc( name from, name to, unsigned_int amount );
+
+         [[eosio::action]]
+         void transfermany( name                            from,
+                            const symbol&                   sym,
+                            const vector<transfer_entry>&   transfers );
+
          [[eosio::action]]
          void open( name owner, const symbol& symbol, name ram_payer );
 
          [[eosio::action]]
          void close( name owner, const symbol& symbol );
 
+         [[eosio::action]]
+         void closemany( name owner, const vector<symbol>& symbols );
+
+         /**
+          * Lets sweep erase the owner's zero balance rows. The consent is
+          * used up (and its row erased) once all of the owner's rows were
+          * visited.
+          */
+         [[eosio::action]]
+         void allowsweep( name owner );
+
+         [[eosio::action]]
+         void sweep( uint32_t max_rows );
+
+#ifndef BRM_NO_STAKING
 	 /* stake related actions */
 
 	 [[eosio::action]]
@@ -58,6 +149,43 @@ namespace eosio {
 	 [[eosio::action]]
 	 void refund(const name owner);
 
+	 [[eosio::action]]
+	 void refundmany(const vector<name>& owners);
+
+	 [[eosio::action]]
+	 void distribute(asset reward);
+
+	 [[eosio::action]]
+	 void claimreward(const name owner);
+
+	 /**
+	  * Read-only: prints the packed vector<account_position> of the given
+	  * owners as hex to the action console, so wallets get liquid, staked,
+	  * locked and pending BRM in one call. Meant to be run without being
+	  * broadcast.
+	  */
+	 [[eosio::action]]
+	 void getpositions(const vector<name>& owners);
+
+	 [[eosio::action]]
+	 void audit(const vector<name>& owners, bool strict);
+
+	 /**
+	  * Moves the legacy configs row into stakestate and settings, or
+	  * starts stakestate at zero when there is none. stake, distribute
+	  * and migratestake refuse to run until it did.
+	  */
+	 [[eosio::action]]
+	 void splitconfig();
+
+	 [[eosio::action]]
+	 void migratestake(uint32_t max_rows);
+
+	 [[eosio::action]]
+	 void migratelocks(const vector<name>& owners);
+#endif
+
+#ifndef BRM_NO_INVOICES
 	 [[eosio::action]]
 	 void sendinvoice(name from, name to, asset invoice_total, uint32_t payment_due, string descr);
 
@@ -67,6 +195,45 @@ namespace eosio {
 	 [[eosio::action]]
 	 void rejectinvoice(name payer, uint64_t invoice_id, string reason);
 
+	 [[eosio::action]]
+	 void purgeinvs(name merchant, uint32_t cutoff, uint32_t max_rows);
+
+	 [[eosio::action]]
+	 void migrateinvs(name merchant, uint32_t max_rows);
+
+	 /**
+	  * Standing authorization for merchant to collect up to cap from
+	  * customer every period seconds (0 = cap is a one-off total).
+	  */
+	 [[eosio::action]]
+	 void setallowance(name customer, name merchant, asset cap, uint32_t period);
+
+	 [[eosio::action]]
+	 void delallowance(name customer, name merchant);
+
+	 /**
+	  * Settles up to max_rows open invoices of merchant, due at or after
+	  * from_due, against the customers' allowances.
+	  */
+	 [[eosio::action]]
+	 void collectinvs(name merchant, uint32_t from_due, uint32_t max_rows);
+
+	 /**
+	  * Bills to amount every period seconds from first_due on, from a
+	  * single template row; periods are only settled when paid.
+	  */
+	 [[eosio::action]]
+	 void sendrecurring(name from, name to, asset amount, uint32_t period, uint32_t first_due, string descr);
+
+	 [[eosio::action]]
+	 void payrecurring(name payer, uint64_t template_id, uint32_t max_periods);
+
+	 [[eosio::action]]
+	 void collectrecur(name merchant, uint32_t from_due, uint32_t max_rows);
+
+	 [[eosio::action]]
+	 void endrecurring(name merchant, uint64_t template_id);
+#endif
 
 	/* end of stake actions */
 
@@ -84,7 +251,14 @@ namespace eosio {
             return ac.balance;
          }
 
+         // decodes the hot actions without copying their strings, returns
+         // false for actions left to execute_action
+         static bool dispatch_in_place( name receiver, name code, name action );
+
       private:
+         // the offline reconciler in tools unpacks exported rows with these
+         friend struct brm_reconcile::rows;
+
          struct [[eosio::table]] account {
             asset    balance;
 
@@ -99,19 +273,45 @@ namespace eosio {
             uint64_t primary_key()const { return supply.symbol.code().raw(); }
          };
 
+         struct [[eosio::table]] sweep_consent {
+            name     owner;
+
+            uint64_t primary_key()const { return owner.value; }
+         };
+
          typedef eosio::multi_index< "accounts"_n, account > accounts;
          typedef eosio::multi_index< "stat"_n, currency_stats > stats;
+         typedef eosio::multi_index< "sweeps"_n, sweep_consent > sweep_consents;
+
+         static constexpr symbol BRM_SYMBOL = symbol("BRM", 3);
+
+         void check_symbol( const symbol& sym ) const
+         {
+#ifdef BRM_SINGLE_TOKEN
+            eosio_assert( sym == BRM_SYMBOL, "symbol precision mismatch" );
+#else
+            stats statstable( _self, sym.code().raw() );
+            const auto& st = statstable.get( sym.code().raw() );
+            eosio_assert( sym == st.supply.symbol, "symbol precision mismatch" );
+#endif
+         }
+
+         void _issue( name to, const asset& quantity, std::string_view memo );
+         void _retire( const asset& quantity, std::string_view memo );
+         void _transfer( name from, name to, const asset& quantity, std::string_view memo );
 
          void sub_balance( name owner, asset value );
          void add_balance( name owner, asset value, name ram_payer );
 	
 
+#ifndef BRM_NO_STAKING
 	 /** stake related */
 
      	const uint16_t  WEEK_MULTIPLIERX100 = 100;
     	const uint16_t  MONTH_MULTIPLIERX100 = 150;
     	const uint16_t  QUARTER_MULTIPLIERX100 = 200;
     	const int64_t   BASE_WEEKLY = 20000000000;
+    	const uint64_t  REWARD_PRECISION = 1000000000;                 // fixed point scale of stakestate.reward_per_share
 
     	const uint8_t   WEEKLY = 1;
     	const uint8_t   MONTHLY = 2;
@@ -125,10 +325,48 @@ namespace eosio {
     	const uint32_t   MONTH_WAIT =   (60 * 60 * 24 * 7 * 4);
     	const uint32_t   QUARTER_WAIT = (60 * 60 * 24 * 7 * 4 * 3);
     	const uint32_t   TENDAY_WAIT = (60 * 60 * 24 * 10);
+    	const uint8_t    MAX_LOCK_TRANCHES = 16;
 
 
+    	// counters touched by every stake/unstake/distribute, kept small and
+    	// fixed size. Amounts are raw BRM_SYMBOL units
+    	struct [[eosio::table]] stake_state {
+        	uint32_t        active_accounts;
+        	int64_t         staked_weekly;
+        	int64_t         staked_monthly;
+        	int64_t         staked_quarterly;
+        	int64_t         total_staked;
+        	uint64_t        total_shares;
+        	uint64_t        reward_per_share;       // cumulative reward per weighted share, x REWARD_PRECISION
+        	int64_t         total_payout;
+        	int64_t         unclaimed_tokens;
+
+        	EOSLIB_SERIALIZE (stake_state, (active_accounts)(staked_weekly)(staked_monthly)(staked_quarterly)(total_staked)(total_shares)(reward_per_share)(total_payout)(unclaimed_tokens));
+    	};
+
+    	typedef eosio::singleton<"stakestate"_n, stake_state> stake_state_table;
+
+    	// rarely changed staking settings, not read on the staking hot path
+    	struct [[eosio::table]] stake_settings {
+        	uint8_t         running;
+        	name    	overflow;
+        	asset           total_escrowed_monthly;
+        	asset           total_escrowed_quarterly;
+        	asset           base_payout;
+        	asset           bonus;
+        	asset           interest_share;
+        	asset           spare_a1;
+        	asset           spare_a2;
+        	uint64_t        spare_i2;
+
+        	EOSLIB_SERIALIZE (stake_settings, (running)(overflow)(total_escrowed_monthly)(total_escrowed_quarterly)(base_payout)(bonus)(interest_share)(spare_a1)(spare_a2)(spare_i2));
+    	};
+
+    	typedef eosio::singleton<"settings"_n, stake_settings> stake_settings_table;
+
     	// @abi table configs i64
-    	struct [[eosio::table]] config {
+    	// single row layout before stakestate/settings, only read by splitconfig
+    	struct [[eosio::table]] legacy_config {
         	uint64_t        config_id;
         	uint8_t         running;
         	name    	overflow;
@@ -152,14 +390,32 @@ namespace eosio {
 
         	uint64_t    primary_key() const { return config_id; }
 
-        	EOSLIB_SERIALIZE (config, (config_id)(running)(overflow)(active_accounts)(staked_weekly)(staked_monthly)(staked_quarterly)(total_staked)(total_escrowed_monthly)(total_escrowed_quarterly)(total_shares)(base_payout)(bonus)(total_payout)(interest_share)(unclaimed_tokens)
+        	EOSLIB_SERIALIZE (legacy_config, (config_id)(running)(overflow)(active_accounts)(staked_weekly)(staked_monthly)(staked_quarterly)(total_staked)(total_escrowed_monthly)(total_escrowed_quarterly)(total_shares)(base_payout)(bonus)(total_payout)(interest_share)(unclaimed_tokens)
         (spare_a1)(spare_a2)(spare_i1)(spare_i2));
     	};
 
-    	typedef eosio::multi_index<"configs"_n, config> config_table;
+    	typedef eosio::multi_index<"configs"_n, legacy_config> legacy_config_table;
 
-    	// @abi table stakes i64
+    	// amounts are raw BRM_SYMBOL units, fields ordered widest first. Like
+    	// locks, one row per owner scope keyed by the BRM symbol code
     	struct [[eosio::table]] stake_row {
+        	int64_t         staked;
+        	int64_t         escrow;                 // rewards settled but not yet claimed
+        	uint64_t        reward_checkpoint;      // stakestate.reward_per_share at the last settlement
+        	uint32_t        stake_date;
+        	uint32_t        stake_due;
+        	uint8_t         stake_period;
+
+        	uint64_t        primary_key () const { return BRM_SYMBOL.code().raw(); }
+
+        	EOSLIB_SERIALIZE (stake_row, (staked)(escrow)(reward_checkpoint)(stake_date)(stake_due)(stake_period));
+    	};
+
+   	typedef eosio::multi_index<"stakebals"_n, stake_row> stake_table;
+
+    	// @abi table stakes i64
+    	// deployed row layout, only read by migratestake
+    	struct [[eosio::table]] legacy_stake_row {
         	name    	stake_account;
         	uint8_t         stake_period;
         	asset           staked;
@@ -169,36 +425,85 @@ namespace eosio {
 
         	uint64_t        primary_key () const { return stake_account.value; }
 
-        	EOSLIB_SERIALIZE (stake_row, (stake_account)(stake_period)(staked)(stake_date)(stake_due)(escrow));
+        	EOSLIB_SERIALIZE (legacy_stake_row, (stake_account)(stake_period)(staked)(stake_date)(stake_due)(escrow));
     	};
 
-   	typedef eosio::multi_index<"stakes"_n, stake_row> stake_table;
+   	typedef eosio::multi_index<"stakes"_n, legacy_stake_row> legacy_stake_table;
+
+	uint64_t stake_shares(uint8_t period, int64_t amount) const;
+	int64_t  pending_reward(uint8_t period, int64_t staked, uint64_t checkpoint, uint64_t reward_per_share) const;
+	int64_t  pending_reward(const stake_row& s, uint64_t reward_per_share) const
+	{
+		return pending_reward(s.stake_period, s.staked, s.reward_checkpoint, reward_per_share);
+	}
+
+	struct lock_tranche {
+		int64_t         amount;
+		uint32_t        due;
+	};
 
+	// every unstake queues its own tranche of raw BRM_SYMBOL units, oldest
+	// first. The row lives in the owner's scope and only ever exists once
+	// there, so it needs no account field of its own
 	struct [[eosio::table]] lock_balance {
+		vector<lock_tranche> tranches;
+
+		uint64_t        primary_key () const { return BRM_SYMBOL.code().raw(); }
+		int64_t         locked () const
+		{
+			int64_t total = 0;
+			for (const auto& t : tranches) {
+				total += t.amount;
+			}
+			return total;
+		}
+        };
+
+	typedef multi_index<"locks"_n, lock_balance> lock_balances;
+
+	// deployed row layout, a single lock released at refund_due. Only
+	// read by migratelocks
+	struct [[eosio::table]] legacy_lock_balance {
 		name            stake_account;
                 asset 		locked_balance;
 		uint32_t        refund_due;
 
-                //uint64_t primary_key() const { return locked_balance.symbol.code().raw(); }
 		uint64_t        primary_key () const { return stake_account.value; }
         };
 
-	typedef multi_index<"lockedbals"_n, lock_balance> lock_balances;
+	typedef multi_index<"lockedbals"_n, legacy_lock_balance> legacy_lock_balances;
 
 
 	inline asset get_locked_balance(name account)
         {
                 lock_balances lockbalances(_self, account.value);
-                auto ac = lockbalances.find(account.value);
+                auto ac = lockbalances.find(BRM_SYMBOL.code().raw());
                 if (ac == lockbalances.end())
                 {
-                        return asset(0, symbol("BRM", 3));
+                        return asset(0, BRM_SYMBOL);
                 }
-                return ac->locked_balance;
+                return asset(ac->locked(), BRM_SYMBOL);
         }
 	
+	// progress and partial sums of a running audit
+	struct [[eosio::table]] audit_state {
+		uint64_t        cursor;                 // last owner counted
+		uint32_t        active_accounts;
+		int64_t         staked_weekly;
+		int64_t         staked_monthly;
+		int64_t         staked_quarterly;
+		uint64_t        total_shares;
+		int64_t         balances;
+		int64_t         locked;
+	};
+
+	typedef eosio::singleton<"auditstate"_n, audit_state> audit_state_table;
+
 	void unlock_balance(name owner);
+	asset release_matured(name owner);
+#endif
 
+#ifndef BRM_NO_INVOICES
 	/** start utility payments **/
 
 	const uint8_t   BRM_INVOICE_STATUS_OPEN = 1;
@@ -207,9 +512,31 @@ namespace eosio {
 	const uint8_t   BRM_INVOICE_STATUS_REJECTED = 4;
 	const uint8_t   BRM_INVOICE_STATUS_WRITEOFF = 5;
 
+	const uint32_t  MAX_RECURRING_PERIOD = (60 * 60 * 24 * 366);
+
 
-	//merchant invoice
+	//merchant invoice, fixed size so status changes rewrite a small row.
+	//the description is interned in descrs, the row only keeps its key
 	struct [[eosio::table]] utility_invoice {
+		uint64_t	invoice_id_key;
+		uint8_t		invoice_status;
+                name            from_account;
+                name            to_account;
+                asset           invoice_total;
+                asset           paid_total;
+                uint32_t        payment_due;
+                uint32_t        payment_date;
+                uint64_t        payment_id;
+                uint64_t        descr_key;              // 0 = no description
+		
+                uint64_t        primary_key () const { return invoice_id_key; }
+                uint64_t        by_status_due () const { return (uint64_t(invoice_status) << 32) | payment_due; }
+                uint64_t        by_customer () const { return to_account.value; }
+        };
+
+	// deployed row layout, payment_id in decimal and the description
+	// inline. Only read by migrateinvs
+	struct [[eosio::table]] legacy_utility_invoice {
 		uint64_t	invoice_id_key;
 		uint8_t		invoice_status;
                 name            from_account;
@@ -220,10 +547,22 @@ namespace eosio {
                 uint32_t        payment_date;
                 string          payment_id;
 		string		invoice_descr;
-		
+
                 uint64_t        primary_key () const { return invoice_id_key; }
         };
 
+	// description text shared by every invoice and template using it,
+	// contract scope. The key is the first 8 bytes of the text's sha256,
+	// moved on to the next free key on a collision. refs counts the rows
+	// pointing at it, the last one to go takes the text with it
+	struct [[eosio::table]] invoice_descr {
+		uint64_t	descr_key;
+		uint32_t	refs;
+		string		text;
+
+                uint64_t        primary_key () const { return descr_key; }
+        };
+
 	//user received invoice
 	struct [[eosio::table]] customer_invoice {
                 uint64_t        invoice_id_key;
@@ -232,10 +571,88 @@ namespace eosio {
                 uint64_t        primary_key () const { return invoice_id_key; }
         };
 
-        typedef multi_index<"uinvoices"_n, utility_invoice> uinvoice_table;
+        typedef multi_index<"minvoices"_n, utility_invoice,
+                indexed_by<"statusdue"_n, const_mem_fun<utility_invoice, uint64_t, &utility_invoice::by_status_due>>,
+                indexed_by<"customer"_n, const_mem_fun<utility_invoice, uint64_t, &utility_invoice::by_customer>>
+        > uinvoice_table;
+        typedef multi_index<"uinvoices"_n, legacy_utility_invoice> legacy_uinvoice_table;
         typedef multi_index<"cinvoices"_n, customer_invoice> cinvoice_table;
-
-	void _notify(name invoice_status, const string message, const utility_invoice& d);
+        typedef multi_index<"descrs"_n, invoice_descr> descr_table;
+
+	// invoice and payment ids are handed out from one counter row in the
+	// contract scope, ids must be unique across merchants because the
+	// customer scope (cinvoices) is keyed by invoice id as well.
+	// counting starts above 2^32 so it never hits the 4 byte hash ids
+	// handed out by older versions of sendinvoice
+	struct [[eosio::table]] id_counter {
+		uint64_t	next_invoice_id = 1ull << 32;
+		uint64_t	next_payment_id = 1;
+	};
+
+	typedef eosio::singleton<"idcounter"_n, id_counter> id_counter_table;
+
+	// standing authorization of a merchant, customer scope keyed by
+	// merchant. spent counts what collectinvs took in the current period
+	struct [[eosio::table]] allowance {
+		name		merchant;
+		asset		cap;
+		asset		spent;
+		uint32_t	period;			// seconds, 0 = no renewal
+		uint32_t	period_start;
+
+		uint64_t	primary_key () const { return merchant.value; }
+	};
+
+	typedef multi_index<"allowances"_n, allowance> allowance_table;
+
+	// recurring invoice template, merchant scope. Nothing is written per
+	// billing period: next_due is the due date of the oldest unpaid period
+	// and what is owed is worked out from it on payment or collection. The
+	// customer sees the template as a cinvoices row under template_id
+	struct [[eosio::table]] recurring_invoice {
+		uint64_t	template_id;
+		name		to_account;
+		asset		amount;			// per period
+		uint32_t	period;
+		uint32_t	next_due;
+		uint64_t	payment_id;		// of the last settlement
+		uint64_t	descr_key;
+
+		uint64_t	primary_key () const { return template_id; }
+		uint64_t	by_due () const { return next_due; }
+	};
+
+	typedef multi_index<"rtemplates"_n, recurring_invoice,
+		indexed_by<"nextdue"_n, const_mem_fun<recurring_invoice, uint64_t, &recurring_invoice::by_due>>
+	> recurring_table;
+
+	inline uint32_t periods_due(const recurring_invoice& r, uint32_t now_ts) const
+	{
+		return now_ts < r.next_due ? 0 : (now_ts - r.next_due) / r.period + 1;
+	}
+
+	// next_due once periods more are settled
+	inline uint32_t advance_due(const recurring_invoice& r, uint32_t periods) const
+	{
+		uint64_t due = uint64_t(r.next_due) + uint64_t(periods) * r.period;
+		eosio_assert(due <= std::numeric_limits<uint32_t>::max(), "next due date out of range");
+		return static_cast<uint32_t>(due);
+	}
+
+	uint32_t charge_allowance(name customer, name merchant, const asset& unit, uint32_t units, uint32_t now_ts);
+
+	uint64_t next_invoice_id();
+	uint64_t next_payment_id();
+
+	void _sendinvoice(name from, name to, const asset& invoice_total, uint32_t payment_due, std::string_view descr);
+
+	uint64_t intern_descr(std::string_view descr);
+	void release_descr(uint64_t descr_key);
+
+	void _notify(name invoice_status, const string message, const utility_invoice& d, const string& note);
+	void _notify(name invoice_status, const string message, uint64_t invoice_id, name from, name to,
+		     const asset& quantity, uint32_t payment_due, uint64_t descr_key, const string& note);
+#endif
 
 };
 
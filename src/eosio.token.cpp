@@ -5,8 +5,47 @@
 
 #include <eosio.token/eosio.token.hpp>
 
+#include <alloca.h>
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+
 namespace eosio {
 
+namespace {
+
+   // sorts (account, amount) credits by account and folds duplicates
+   // together, so every account is credited and notified once
+   void merge_credits( vector<std::pair<name, int64_t>>& credits ) {
+      std::sort( credits.begin(), credits.end(), []( const auto& a, const auto& b ) {
+         return a.first < b.first;
+      });
+      size_t merged = 0;
+      for( size_t i = 0; i < credits.size(); ++i ) {
+         if( merged > 0 && credits[merged - 1].first == credits[i].first ) {
+            credits[merged - 1].second += credits[i].second;
+         } else {
+            credits[merged++] = credits[i];
+         }
+      }
+      credits.resize( merged );
+   }
+
+#ifndef BRM_NO_INVOICES
+   // decimal payment ids as the deployed payinvoice wrote them, 0 if empty
+   uint64_t parse_payment_id( std::string_view id ) {
+      uint64_t value = 0;
+      for( char c : id ) {
+         eosio_assert( c >= '0' && c <= '9', "malformed payment id" );
+         eosio_assert( value <= ( std::numeric_limits<uint64_t>::max() - uint64_t( c - '0' ) ) / 10, "malformed payment id" );
+         value = value * 10 + uint64_t( c - '0' );
+      }
+      return value;
+   }
+#endif
+
+}
+
 void token::create( name   issuer,
                     asset  maximum_supply )
 {
@@ -14,6 +53,9 @@ void token::create( name   issuer,
 
     auto sym = maximum_supply.symbol;
     eosio_assert( sym.is_valid(), "invalid symbol name" );
+#ifdef BRM_SINGLE_TOKEN
+    eosio_assert( sym == BRM_SYMBOL, "this build only supports the BRM token" );
+#endif
     eosio_assert( maximum_supply.is_valid(), "invalid supply");
     eosio_assert( maximum_supply.amount > 0, "max-supply must be positive");
 
@@ -30,6 +72,11 @@ void token::create( name   issuer,
 
 
 void token::issue( name to, asset quantity, string memo )
+{
+    _issue( to, quantity, memo );
+}
+
+void token::_issue( name to, const asset& quantity, std::string_view memo )
 {
     auto sym = quantity.symbol;
     eosio_assert( sym.is_valid(), "invalid symbol name" );
@@ -51,16 +98,64 @@ void token::issue( name to, asset quantity, string memo )
        s.supply += quantity;
     });
 
-    add_balance( st.issuer, quantity, st.issuer );
-
+    // credit the recipient directly instead of going through the issuer
+    // and an inline transfer
     if( to != st.issuer ) {
-      SEND_INLINE_ACTION( *this, transfer, { {st.issuer, "active"_n} },
-                          { st.issuer, to, quantity, memo }
-      );
+      eosio_assert( is_account( to ), "to account does not exist" );
+      require_recipient( to );
+    }
+
+    auto payer = has_auth( to ) ? to : st.issuer;
+    add_balance( to, quantity, payer );
+}
+
+void token::issuemany( const symbol& sym, name ram_payer, const vector<issue_entry>& issues )
+{
+    eosio_assert( sym.is_valid(), "invalid symbol name" );
+    eosio_assert( !issues.empty(), "no recipients given" );
+
+    stats statstable( _self, sym.code().raw() );
+    auto existing = statstable.find( sym.code().raw() );
+    eosio_assert( existing != statstable.end(), "token with symbol does not exist, create token before issue" );
+    const auto& st = *existing;
+
+    require_auth( st.issuer );
+    require_auth( ram_payer );
+    eosio_assert( sym == st.supply.symbol, "symbol precision mismatch" );
+
+    vector<std::pair<name, int64_t>> credits;
+    credits.reserve( issues.size() );
+    int64_t total = 0;
+    for( const auto& i : issues ) {
+       eosio_assert( i.quantity.is_valid(), "invalid quantity" );
+       eosio_assert( i.quantity.amount > 0, "must issue positive quantity" );
+       eosio_assert( i.quantity.symbol == sym, "symbol precision mismatch" );
+       total += i.quantity.amount;
+       eosio_assert( total <= st.max_supply.amount - st.supply.amount, "quantity exceeds available supply" );
+       credits.emplace_back( i.to, i.quantity.amount );
+    }
+
+    merge_credits( credits );
+
+    statstable.modify( st, same_payer, [&]( auto& s ) {
+       s.supply.amount += total;
+    });
+
+    for( const auto& c : credits ) {
+       if( c.first != st.issuer ) {
+          eosio_assert( is_account( c.first ), "to account does not exist" );
+          require_recipient( c.first );
+       }
+       add_balance( c.first, asset( c.second, sym ), ram_payer );
     }
 }
 
 void token::retire( asset quantity, string memo )
+{
+    _retire( quantity, memo );
+}
+
+void token::_retire( const asset& quantity, std::string_view memo )
 {
     auto sym = quantity.symbol;
     eosio_assert( sym.is_valid(), "invalid symbol name" );
@@ -88,20 +183,22 @@ void token::transfer( name    from,
                       name    to,
                       asset   quantity,
                       string  memo )
+{
+    _transfer( from, to, quantity, memo );
+}
+
+void token::_transfer( name from, name to, const asset& quantity, std::string_view memo )
 {
     eosio_assert( from != to, "cannot transfer to self" );
     require_auth( from );
     eosio_assert( is_account( to ), "to account does not exist");
-    auto sym = quantity.symbol.code();
-    stats statstable( _self, sym.raw() );
-    const auto& st = statstable.get( sym.raw() );
 
     require_recipient( from );
     require_recipient( to );
 
     eosio_assert( quantity.is_valid(), "invalid quantity" );
     eosio_assert( quantity.amount > 0, "must transfer positive quantity" );
-    eosio_assert( quantity.symbol == st.supply.symbol, "symbol precision mismatch" );
+    check_symbol( quantity.symbol );
     eosio_assert( memo.size() <= 256, "memo has more than 256 bytes" );
 
     auto payer = has_auth( to ) ? to : from;
@@ -110,13 +207,70 @@ void token::transfer( name    from,
     add_balance( to, quantity, payer );
 }
 
+void token::transferc( name from, name to, unsigned_int amount )
+{
+    _transfer( from, to, asset( amount.value, BRM_SYMBOL ), std::string_view() );
+}
+
+void token::transfermany( name                            from,
+                          const symbol&                   sym,
+                          const vector<transfer_entry>&   transfers )
+{
+    require_auth( from );
+    eosio_assert( !transfers.empty(), "no transfers given" );
+    check_symbol( sym );
+
+    // validate every entry up front and fold duplicate recipients together,
+    // so the sender row is debited once and each recipient is credited and
+    // notified once
+    vector<std::pair<name, int64_t>> credits;
+    credits.reserve( transfers.size() );
+    int64_t total = 0;
+    for( const auto& t : transfers ) {
+       eosio_assert( from != t.to, "cannot transfer to self" );
+       eosio_assert( t.quantity.is_valid(), "invalid quantity" );
+       eosio_assert( t.quantity.amount > 0, "must transfer positive quantity" );
+       eosio_assert( t.quantity.symbol == sym, "symbol precision mismatch" );
+       eosio_assert( t.memo.size() <= 256, "memo has more than 256 bytes" );
+       total += t.quantity.amount;
+       eosio_assert( total <= asset::max_amount, "transfer total overflow" );
+       credits.emplace_back( t.to, t.quantity.amount );
+    }
+
+    merge_credits( credits );
+
+    sub_balance( from, asset( total, sym ) );
+    require_recipient( from );
+
+    for( const auto& c : credits ) {
+       eosio_assert( is_account( c.first ), "to account does not exist" );
+       require_recipient( c.first );
+
+       auto payer = has_auth( c.first ) ? c.first : from;
+       add_balance( c.first, asset( c.second, sym ), payer );
+    }
+}
+
 void token::sub_balance( name owner, asset value ) {
+#ifndef BRM_NO_STAKING
+   // matured unstaked tranches are credited on the owner's next debit, so
+   // the funds are usable and the lock row is freed without a refund
+   if( value.symbol == BRM_SYMBOL ) {
+      asset released = release_matured( owner );
+      if( released.amount > 0 ) {
+         add_balance( owner, released, owner );
+      }
+   }
+#endif
+
    accounts from_acnts( _self, owner.value );
 
    const auto& from = from_acnts.get( value.symbol.code().raw(), "no balance object found" );
    eosio_assert( from.balance.amount >= value.amount, "overdrawn balance" );
 
-   from_acnts.modify( from, owner, [&]( auto& a ) {
+   // the row does not grow, so keep its payer; the owner has not always
+   // signed (collectinvs debits under the merchant's authority)
+   from_acnts.modify( from, same_payer, [&]( auto& a ) {
          a.balance -= value;
       });
 }
@@ -165,7 +319,61 @@ void token::close( name owner, const symbol& symbol )
    acnts.erase( it );
 }
 
+void token::closemany( name owner, const vector<symbol>& symbols )
+{
+   require_auth( owner );
+   eosio_assert( !symbols.empty(), "no symbols given" );
+   accounts acnts( _self, owner.value );
+   for( const auto& sym : symbols ) {
+      auto it = acnts.find( sym.code().raw() );
+      eosio_assert( it != acnts.end(), "Balance row already deleted or never existed. Action won't have any effect." );
+      eosio_assert( it->balance.amount == 0, "Cannot close because the balance is not zero." );
+      acnts.erase( it );
+   }
+}
+
+void token::allowsweep( name owner )
+{
+   require_auth( owner );
+   sweep_consents consents( _self, _self.value );
+   eosio_assert( consents.find( owner.value ) == consents.end(), "sweep already allowed" );
+   consents.emplace( owner, [&]( auto& c ) {
+      c.owner = owner;
+   });
+}
+
+void token::sweep( uint32_t max_rows )
+{
+   eosio_assert( max_rows > 0, "max_rows must be positive" );
+
+   // only owners who called allowsweep are visited, max_rows bounds the
+   // balance rows looked at per call. An owner whose rows are not all
+   // visited keeps the consent row and is continued by the next call
+   sweep_consents consents( _self, _self.value );
+   auto c = consents.begin();
+   eosio_assert( c != consents.end(), "Nothing to sweep" );
+
+   uint32_t visited = 0;
+   while( c != consents.end() && visited < max_rows ) {
+      accounts acnts( _self, c->owner.value );
+      auto it = acnts.begin();
+      while( it != acnts.end() && visited < max_rows ) {
+         if( it->balance.amount == 0 ) {
+            it = acnts.erase( it );
+         } else {
+            ++it;
+         }
+         visited++;
+      }
+      if( it != acnts.end() ) {
+         break;
+      }
+      c = consents.erase( c );
+   }
+}
+
 
+#ifndef BRM_NO_STAKING
 /** BRM staking fucntions **/
 
 
@@ -173,20 +381,18 @@ void token::stake(name _stake_account, asset _staked)
 {
     require_auth(_stake_account);
     uint8_t _stake_period = 1;
-    config_table c_t (_self, _self.value);
-    auto c_itr = c_t.find(0);
-    const auto& c_it = *c_itr;
-    stake_table s_t(_self, _self.value);
+    stake_state_table ss_t(_self, _self.value);
+    eosio_assert(ss_t.exists(), "staking is not configured");
+    auto ss = ss_t.get();
+    uint64_t reward_per_share = ss.reward_per_share;
+    stake_table s_t(_self, _stake_account.value);
     //eosio_assert(c_itr->running != 0,"staking is currently disabled.");
     eosio_assert(is_account(_stake_account), "to account does not exist");
-    auto sym = _staked.symbol.code();
-    stats statstable(_self, sym.raw());
-    const auto &st = statstable.get(sym.raw());
     eosio_assert(_staked.is_valid(), "invalid quantity");
     eosio_assert(_staked.amount > 0, "must transfer positive quantity");
-    eosio_assert(_staked.symbol == st.supply.symbol, "symbol precision mismatch");
+    eosio_assert(_staked.symbol == BRM_SYMBOL, "only BRM can be staked");
     eosio_assert(_stake_period >= 1 && _stake_period <= 3, "Invalid stake period.");
-    auto itr = s_t.find(_stake_account.value);
+    auto itr = s_t.find(BRM_SYMBOL.code().raw());
     //eosio_assert(itr == s_t.end(), "Account already has a stake. Must unstake first.");
 
     sub_balance(_stake_account, _staked);
@@ -194,15 +400,24 @@ void token::stake(name _stake_account, asset _staked)
     //unlock_balance(_stake_account);
     //asset total_staked = _staked + locked_balance;
 
-    asset setme = _staked;
-    setme -= _staked;                                                           // get a zero asset value to plug into the escrow row.
+    // settle what the existing stake earned so far before its weight changes
+    uint32_t new_account = itr == s_t.end() ? 1 : 0;
+    uint64_t old_shares = 0;
+    int64_t accrued = 0;
+    int64_t new_staked = _staked.amount;
+    if (itr != s_t.end()) {
+        old_shares = stake_shares(itr->stake_period, itr->staked);
+        accrued = pending_reward(*itr, reward_per_share);
+        new_staked += itr->staked;
+    }
+    uint64_t new_shares = stake_shares(_stake_period, new_staked);
 
     if (itr == s_t.end()) {
     	s_t.emplace(_stake_account, [&](auto &s) {
-        	s.stake_account = _stake_account;
         	s.stake_period = _stake_period;
-        	s.staked =  _staked;
-        	s.escrow = setme;
+        	s.staked =  _staked.amount;
+        	s.escrow = 0;
+        	s.reward_checkpoint = reward_per_share;
         	if(_stake_period == WEEKLY){
           		s.stake_due = now() + WEEK_WAIT;
           		s.stake_date = now()+ WEEK_WAIT;
@@ -219,10 +434,10 @@ void token::stake(name _stake_account, asset _staked)
 
    } else {
 	s_t.modify(itr, _self, [&](auto &s) {
-                s.stake_account = _stake_account;
                 s.stake_period = _stake_period;
-                s.staked +=  _staked;
-                s.escrow = setme;
+                s.staked +=  _staked.amount;
+                s.escrow += accrued;
+                s.reward_checkpoint = reward_per_share;
                 if(_stake_period == WEEKLY){
                         s.stake_due = now() + WEEK_WAIT;
                         s.stake_date = now()+ WEEK_WAIT;
@@ -239,38 +454,19 @@ void token::stake(name _stake_account, asset _staked)
 
    }
 
-    if (c_itr == c_t.end() ) {
-    	c_t.emplace(_stake_account, [&](auto &c) {
-        c.active_accounts += 1;
-        c.total_staked.amount += _staked.amount;
-        if (_stake_period == WEEKLY) {
-          c.staked_weekly.amount += _staked.amount;
-        }
-        else if (_stake_period == MONTHLY) {
-          c.staked_monthly.amount += _staked.amount;
-        }
-        else if (_stake_period == QUARTERLY) {
-          c.staked_quarterly.amount += _staked.amount;
-        }
-    });
-
-    }else {
-
-	c_t.modify(c_itr, _self, [&](auto &c) {
-        c.active_accounts += 1;
-        c.total_staked.amount += _staked.amount;
-        if (_stake_period == WEEKLY) {
-          c.staked_weekly.amount += _staked.amount;
-        }
-        else if (_stake_period == MONTHLY) {
-          c.staked_monthly.amount += _staked.amount;
-        }
-        else if (_stake_period == QUARTERLY) {
-          c.staked_quarterly.amount += _staked.amount;
-        }
-    });
-
+    ss.active_accounts += new_account;
+    ss.total_staked += _staked.amount;
+    ss.total_shares += new_shares - old_shares;
+    if (_stake_period == WEEKLY) {
+      ss.staked_weekly += _staked.amount;
+    }
+    else if (_stake_period == MONTHLY) {
+      ss.staked_monthly += _staked.amount;
+    }
+    else if (_stake_period == QUARTERLY) {
+      ss.staked_quarterly += _staked.amount;
     }
+    ss_t.set(ss, _self);
 
 	
 }
@@ -279,15 +475,15 @@ void token::stake(name _stake_account, asset _staked)
 
 void token::unstake(name _stake_account, asset _unstaked)
 {
-    stake_table s_t(_self, _self.value);
-    auto itr = s_t.find(_stake_account.value);
+    stake_table s_t(_self, _stake_account.value);
+    auto itr = s_t.find(BRM_SYMBOL.code().raw());
     eosio_assert(itr != s_t.end(), "No stake for the user.You must stake first");
-    require_auth(itr->stake_account);
+    require_auth(_stake_account);
     //add_balance(itr->stake_account, itr->staked, itr->stake_account);
 
-    config_table c_t(_self, _self.value);
-    auto c_itr = c_t.find(0);
-    const auto& c_it = *c_itr;
+    stake_state_table ss_t(_self, _self.value);
+    eosio_assert(ss_t.exists(), "staking is not configured");
+    auto ss = ss_t.get();
     /*eosio_assert(c_itr->running != 0,"staking contract is currently disabled.");
     print("staked amount was ", itr->staked.amount);
     print("staked account was ", itr->stake_account);
@@ -295,61 +491,81 @@ void token::unstake(name _stake_account, asset _unstaked)
       add_balance(_self, itr->escrow, _self);              // return the stored escrow - it was deducted from the contract during payout
     }*/
 
-    eosio_assert(itr->staked >= _unstaked, "You cant unstake more than staked");
+    eosio_assert(_unstaked.symbol == BRM_SYMBOL, "symbol precision mismatch");
+    eosio_assert(_unstaked.amount > 0, "must unstake positive quantity");
+    eosio_assert(itr->staked >= _unstaked.amount, "You cant unstake more than staked");
 
     uint8_t remove_stake_account = 0;
 
-    if(_unstaked == itr->staked) {
+    if(_unstaked.amount == itr->staked) {
 	remove_stake_account = 1;
     }
 
-    c_t.modify(c_itr, _self, [&](auto &c) {                // bookkeeping on the config table to keep the staked & esrowed amounts correct
-    	c.active_accounts -= remove_stake_account;
-    	c.total_staked.amount -= _unstaked.amount;
-    	if (itr->stake_period == WEEKLY) {
-      		c.staked_weekly.amount -= _unstaked.amount;
-    	}
-    	else if ((itr->stake_period == MONTHLY)) {
-      		c.staked_monthly.amount -= _unstaked.amount;
-      		c.total_escrowed_monthly.amount -= itr->escrow.amount;
-    	}
-    	else if ((itr->stake_period == QUARTERLY)) {
-      		c.staked_quarterly.amount -= _unstaked.amount;
-      		c.total_escrowed_quarterly.amount -=  itr->escrow.amount;
-    	}
-  });
+    // settle rewards at the current index; a full unstake pays them out
+    uint64_t reward_per_share = ss.reward_per_share;
+    int64_t accrued = itr->escrow + pending_reward(*itr, reward_per_share);
+    uint64_t old_shares = stake_shares(itr->stake_period, itr->staked);
+    uint64_t new_shares = stake_shares(itr->stake_period, itr->staked - _unstaked.amount);
+
+    // bookkeeping on the staking counters to keep the staked amounts correct
+    ss.active_accounts -= remove_stake_account;
+    ss.total_staked -= _unstaked.amount;
+    ss.total_shares -= old_shares - new_shares;
+    if (remove_stake_account) {
+    	ss.unclaimed_tokens -= accrued;
+    }
+    if (itr->stake_period == WEEKLY) {
+    	ss.staked_weekly -= _unstaked.amount;
+    }
+    else if ((itr->stake_period == MONTHLY)) {
+    	ss.staked_monthly -= _unstaked.amount;
+    }
+    else if ((itr->stake_period == QUARTERLY)) {
+    	ss.staked_quarterly -= _unstaked.amount;
+    }
+    ss_t.set(ss, _self);
   //lock
 
   lock_balances lockbalances(_self, _stake_account.value);
-  auto ac = lockbalances.find(_stake_account.value);
+  auto ac = lockbalances.find(BRM_SYMBOL.code().raw());
+  uint32_t due = now() + TENDAY_WAIT;
   if (ac == lockbalances.end())
   {
   	lockbalances.emplace(_self, [&](auto &account) {
-                account.stake_account = itr->stake_account;
-                account.locked_balance = _unstaked; //itr->staked;
-                account.refund_due = now() + TENDAY_WAIT;
+                account.tranches.push_back(lock_tranche{_unstaked.amount, due});
         });
   }
   else
   {
         lockbalances.modify(ac, _self, [&](auto &row) {
-                row.locked_balance += _unstaked; //itr->staked;
-                row.refund_due = now() + TENDAY_WAIT;
+                // unstakes in the same second share a tranche, a full queue
+                // folds into its newest tranche
+                if (row.tranches.empty()) {
+                        row.tranches.push_back(lock_tranche{_unstaked.amount, due});
+                } else if (row.tranches.back().due == due || row.tranches.size() >= MAX_LOCK_TRANCHES) {
+                        row.tranches.back().amount += _unstaked.amount;
+                        row.tranches.back().due = due;
+                } else {
+                        row.tranches.push_back(lock_tranche{_unstaked.amount, due});
+                }
         });
   }
 
   if(remove_stake_account) {
+  	asset reward(accrued, BRM_SYMBOL);
   	s_t.erase(itr);
   	eosio_assert(itr != s_t.end(), "Stake stat not erased properly");
+  	if (reward.amount > 0) {
+  		add_balance(_stake_account, reward, _stake_account);
+  	}
   }else {
 
 	s_t.modify(itr, _self, [&](auto &s) {
-                s.staked -=  _unstaked;
+                s.staked -=  _unstaked.amount;
+                s.escrow = accrued;
+                s.reward_checkpoint = reward_per_share;
         });
 
-	
-
-
   }
 
 }
@@ -358,13 +574,426 @@ void token::refund(const name owner) {
 
    require_auth(owner);	
    lock_balances lockbalances(_self, owner.value);
-   auto ac = lockbalances.find(owner.value);
+   auto ac = lockbalances.find(BRM_SYMBOL.code().raw());
    eosio_assert(ac != lockbalances.end(), "Nothing to refund");
-   eosio_assert(ac->refund_due < now(), "You need to wait until lock period is over!");
 
-   lockbalances.erase(ac);
-   add_balance(owner, ac->locked_balance, owner);
+   asset released = release_matured(owner);
+   eosio_assert(released.amount > 0, "You need to wait until lock period is over!");
+
+   add_balance(owner, released, owner);
+
+}
+
+void token::refundmany(const vector<name>& owners) {
+
+   require_auth(_self);
+   eosio_assert(!owners.empty(), "no accounts given");
+
+   for (const auto& owner : owners) {
+      asset released = release_matured(owner);
+      if (released.amount > 0) {
+         add_balance(owner, released, _self);
+      }
+   }
+
+}
+
+/** pops every matured tranche off the owner's lock queue, erasing the row
+ *  once it is empty. Returns the released amount */
+asset token::release_matured(name owner) {
+
+   lock_balances lockbalances(_self, owner.value);
+   auto ac = lockbalances.find(BRM_SYMBOL.code().raw());
+   asset released(0, BRM_SYMBOL);
+   if (ac == lockbalances.end()) {
+	return released;
+   }
+
+   size_t matured = 0;
+   for (const auto& t : ac->tranches) {
+	if (t.due >= now()) {
+		break;
+	}
+	released.amount += t.amount;
+	matured++;
+   }
+
+   if (matured == 0) {
+	return released;
+   }
+
+   if (matured == ac->tranches.size()) {
+	lockbalances.erase(ac);
+   } else {
+	lockbalances.modify(ac, _self, [&](auto &row) {
+		row.tranches.erase(row.tranches.begin(), row.tranches.begin() + matured);
+	});
+   }
+
+   return released;
+}
+
+/** rewards
+ *
+ *  distribute only bumps stakestate.reward_per_share, every stake row keeps the
+ *  index it was last settled at. A staker's share of everything distributed
+ *  since then is shares * (reward_per_share - reward_checkpoint), settled
+ *  into escrow on the next stake/unstake/claimreward. Cost does not depend
+ *  on the number of stakers.
+ */
+
+void token::distribute(asset reward)
+{
+    require_auth(_self);
+    eosio_assert(reward.is_valid(), "invalid quantity");
+    eosio_assert(reward.amount > 0, "must distribute positive quantity");
+    eosio_assert(reward.symbol == BRM_SYMBOL, "only BRM can be distributed");
+
+    stake_state_table ss_t(_self, _self.value);
+    eosio_assert(ss_t.exists(), "staking is not configured");
+    legacy_stake_table l_t(_self, _self.value);
+    eosio_assert(l_t.begin() == l_t.end(), "legacy stakes are not migrated yet");
+    auto ss = ss_t.get();
+    eosio_assert(ss.total_shares > 0, "Nothing is staked");
+
+    uint128_t increment = uint128_t(reward.amount) * REWARD_PRECISION / ss.total_shares;
+    eosio_assert(increment > 0, "reward too small for the staked shares");
+    eosio_assert(increment <= std::numeric_limits<uint64_t>::max() - ss.reward_per_share, "reward index overflow");
+
+    // the reward leaves the contract balance and is held in unclaimed_tokens
+    // until the stakers claim it. Rounding dust stays there as well
+    sub_balance(_self, reward);
+
+    ss.reward_per_share += static_cast<uint64_t>(increment);
+    ss.total_payout += reward.amount;
+    ss.unclaimed_tokens += reward.amount;
+    ss_t.set(ss, _self);
+}
+
+void token::claimreward(const name owner)
+{
+    require_auth(owner);
+    stake_table s_t(_self, owner.value);
+    auto itr = s_t.find(BRM_SYMBOL.code().raw());
+    eosio_assert(itr != s_t.end(), "No stake for the user.You must stake first");
+
+    stake_state_table ss_t(_self, _self.value);
+    eosio_assert(ss_t.exists(), "staking is not configured");
+    auto ss = ss_t.get();
+
+    uint64_t reward_per_share = ss.reward_per_share;
+    asset reward(itr->escrow + pending_reward(*itr, reward_per_share), BRM_SYMBOL);
+    eosio_assert(reward.amount > 0, "Nothing to claim");
+
+    s_t.modify(itr, _self, [&](auto &s) {
+        s.escrow = 0;
+        s.reward_checkpoint = reward_per_share;
+    });
+
+    ss.unclaimed_tokens -= reward.amount;
+    ss_t.set(ss, _self);
+
+    add_balance(owner, reward, owner);
+}
+
+void token::getpositions(const vector<name>& owners)
+{
+    eosio_assert(!owners.empty(), "no accounts given");
+
+    stake_state_table ss_t(_self, _self.value);
+    uint64_t reward_per_share = ss_t.get_or_default().reward_per_share;
+
+    vector<account_position> positions;
+    positions.reserve(owners.size());
+    for (const auto& owner : owners) {
+        account_position p{ owner, asset(0, BRM_SYMBOL), asset(0, BRM_SYMBOL), 0, 0, asset(0, BRM_SYMBOL), 0, asset(0, BRM_SYMBOL) };
+
+        accounts acnts(_self, owner.value);
+        auto ac = acnts.find(BRM_SYMBOL.code().raw());
+        if (ac != acnts.end()) {
+            p.balance = ac->balance;
+        }
+
+        stake_table s_t(_self, owner.value);
+        auto itr = s_t.find(BRM_SYMBOL.code().raw());
+        if (itr != s_t.end()) {
+            p.staked.amount = itr->staked;
+            p.stake_period = itr->stake_period;
+            p.stake_due = itr->stake_due;
+            p.pending_reward.amount = itr->escrow + pending_reward(*itr, reward_per_share);
+        }
+
+        lock_balances lockbalances(_self, owner.value);
+        auto lk = lockbalances.find(BRM_SYMBOL.code().raw());
+        if (lk != lockbalances.end()) {
+            p.locked.amount = lk->locked();
+            p.refund_due = lk->tranches.front().due;
+        }
+
+        positions.push_back(p);
+    }
+
+    auto packed = pack(positions);
+    printhex(packed.data(), packed.size());
+}
+
+/** audit
+ *
+ *  Owner scopes cannot be listed on chain, so the owners come in batches
+ *  from off chain (get_table_by_scope over accounts, stakebals and locks),
+ *  in ascending order across the whole audit so none is counted twice.
+ *  Each batch sums the owners' balance, stake and lock rows into
+ *  auditstate. An empty batch ends the audit: the sums are checked against
+ *  the stakestate counters and the BRM supply (supply = balances + staked
+ *  + locked + unclaimed rewards), printed, and the state is reset. With
+ *  strict set a mismatch fails the action. Rows changing between calls
+ *  skew the sums, so the result is only exact when nothing moved while
+ *  the audit ran.
+ */
+
+void token::audit(const vector<name>& owners, bool strict)
+{
+    require_auth(_self);
+
+    audit_state_table audits(_self, _self.value);
+    auto state = audits.get_or_default();
+
+    for (const auto& o : owners) {
+        eosio_assert(o.value > state.cursor, "owners must be in ascending order");
+        state.cursor = o.value;
+        uint64_t owner = o.value;
+        accounts acnts(_self, owner);
+        auto ac = acnts.find(BRM_SYMBOL.code().raw());
+        if (ac != acnts.end()) {
+            state.balances += ac->balance.amount;
+        }
+        stake_table s_t(_self, owner);
+        auto st = s_t.find(BRM_SYMBOL.code().raw());
+        if (st != s_t.end()) {
+            state.active_accounts++;
+            state.total_shares += stake_shares(st->stake_period, st->staked);
+            if (st->stake_period == WEEKLY) {
+                state.staked_weekly += st->staked;
+            }
+            else if (st->stake_period == MONTHLY) {
+                state.staked_monthly += st->staked;
+            }
+            else if (st->stake_period == QUARTERLY) {
+                state.staked_quarterly += st->staked;
+            }
+        }
+        lock_balances lockbalances(_self, owner);
+        auto lk = lockbalances.find(BRM_SYMBOL.code().raw());
+        if (lk != lockbalances.end()) {
+            state.locked += lk->locked();
+        }
+    }
+
+    if (!owners.empty()) {
+        audits.set(state, _self);
+        return;
+    }
+
+    stake_state_table ss_t(_self, _self.value);
+    auto c = ss_t.get_or_default();
+
+    int64_t staked = state.staked_weekly + state.staked_monthly + state.staked_quarterly;
+    int64_t supply = get_supply(_self, BRM_SYMBOL.code()).amount;
+    int64_t accounted = state.balances + staked + state.locked + c.unclaimed_tokens;
+
+    bool ok = c.active_accounts == state.active_accounts
+           && c.total_staked == staked
+           && c.staked_weekly == state.staked_weekly
+           && c.staked_monthly == state.staked_monthly
+           && c.staked_quarterly == state.staked_quarterly
+           && c.total_shares == state.total_shares
+           && supply == accounted;
+
+    print("active_accounts ", c.active_accounts, " counted ", state.active_accounts, "\n");
+    print("total_staked ", c.total_staked, " counted ", staked, "\n");
+    print("staked_weekly ", c.staked_weekly, " counted ", state.staked_weekly, "\n");
+    print("staked_monthly ", c.staked_monthly, " counted ", state.staked_monthly, "\n");
+    print("staked_quarterly ", c.staked_quarterly, " counted ", state.staked_quarterly, "\n");
+    print("total_shares ", c.total_shares, " counted ", state.total_shares, "\n");
+    print("supply ", supply, " accounted ", accounted, " (balances ", state.balances, " staked ", staked,
+          " locked ", state.locked, " unclaimed ", c.unclaimed_tokens, ")\n");
+
+    audits.remove();
+    if (strict) {
+        eosio_assert(ok, "audit found mismatching totals");
+    }
+}
+
+uint64_t token::stake_shares(uint8_t period, int64_t amount) const
+{
+    uint16_t multiplier = WEEK_MULTIPLIERX100;
+    if (period == MONTHLY) {
+        multiplier = MONTH_MULTIPLIERX100;
+    }
+    else if (period == QUARTERLY) {
+        multiplier = QUARTER_MULTIPLIERX100;
+    }
+    return static_cast<uint64_t>(uint128_t(amount) * multiplier / 100);
+}
+
+int64_t token::pending_reward(uint8_t period, int64_t staked, uint64_t checkpoint, uint64_t reward_per_share) const
+{
+    uint128_t delta = reward_per_share - checkpoint;
+    return static_cast<int64_t>(stake_shares(period, staked) * delta / REWARD_PRECISION);
+}
 
+/** splitconfig
+ *
+ *  sets up stakestate, which every staking action that writes it
+ *  requires. The legacy configs row, if there is one, is moved: the
+ *  per period staked totals go to stakestate, the settings to settings.
+ *  Its other counters are not carried over, the deployed contract bumped
+ *  active_accounts on every top-up and never kept total_shares;
+ *  migratestake rebuilds both from the stakes rows. Without a configs row
+ *  (a fresh deployment) stakestate starts at zero. Refuses to run once
+ *  stakestate exists so a second call cannot reset the counters.
+ */
+
+void token::splitconfig()
+{
+    require_auth(_self);
+
+    stake_state_table ss_t(_self, _self.value);
+    eosio_assert(!ss_t.exists(), "stakestate already initialised");
+
+    legacy_config_table c_t(_self, _self.value);
+    auto c_itr = c_t.find(0);
+    if (c_itr == c_t.end()) {
+        ss_t.set(stake_state{}, _self);
+        return;
+    }
+
+    stake_state ss{};
+    ss.staked_weekly = c_itr->staked_weekly.amount;
+    ss.staked_monthly = c_itr->staked_monthly.amount;
+    ss.staked_quarterly = c_itr->staked_quarterly.amount;
+    ss.total_staked = c_itr->total_staked.amount;
+    ss_t.set(ss, _self);
+
+    stake_settings_table st_t(_self, _self.value);
+    stake_settings st;
+    st.running = c_itr->running;
+    st.overflow = c_itr->overflow;
+    st.total_escrowed_monthly = c_itr->total_escrowed_monthly;
+    st.total_escrowed_quarterly = c_itr->total_escrowed_quarterly;
+    st.base_payout = c_itr->base_payout;
+    st.bonus = c_itr->bonus;
+    st.interest_share = c_itr->interest_share;
+    st.spare_a1 = c_itr->spare_a1;
+    st.spare_a2 = c_itr->spare_a2;
+    st.spare_i2 = c_itr->spare_i2;
+    st_t.set(st, _self);
+
+    c_t.erase(c_itr);
+}
+
+/** migration to the compact per owner stakebals/locks rows
+ *
+ *  both run under the contract's authority in bounded batches. A position
+ *  the owner already opened in the new table meanwhile is merged with the
+ *  legacy one rather than overwritten. The deployed contract kept neither
+ *  total_shares nor an exact active_accounts, so each stakes row adds its
+ *  account and shares as it is moved and
+ *  starts from the current reward index; distribute refuses to run while
+ *  any are left. Deployed lockedbals rows become a single tranche due at
+ *  their refund_due.
+ */
+
+void token::migratestake(uint32_t max_rows)
+{
+    require_auth(_self);
+    eosio_assert(max_rows > 0, "max_rows must be positive");
+
+    legacy_stake_table l_t(_self, _self.value);
+    stake_state_table ss_t(_self, _self.value);
+    eosio_assert(ss_t.exists(), "staking is not configured");
+    auto ss = ss_t.get();
+    uint64_t reward_per_share = ss.reward_per_share;
+
+    uint32_t migrated = 0;
+    uint32_t added = 0;
+    uint64_t shares_added = 0;
+    auto l_itr = l_t.begin();
+    while (l_itr != l_t.end() && migrated < max_rows) {
+        const auto& l = *l_itr;
+        stake_table s_t(_self, l.stake_account.value);
+        auto itr = s_t.find(BRM_SYMBOL.code().raw());
+        if (itr == s_t.end()) {
+            s_t.emplace(_self, [&](auto &s) {
+                s.staked = l.staked.amount;
+                s.escrow = l.escrow.amount;
+                s.reward_checkpoint = reward_per_share;
+                s.stake_date = l.stake_date;
+                s.stake_due = l.stake_due;
+                s.stake_period = l.stake_period;
+            });
+            shares_added += stake_shares(l.stake_period, l.staked.amount);
+            added++;
+        } else {
+            int64_t accrued = itr->escrow + pending_reward(*itr, reward_per_share) + l.escrow.amount;
+            shares_added += stake_shares(itr->stake_period, itr->staked + l.staked.amount)
+                          - stake_shares(itr->stake_period, itr->staked);
+
+            s_t.modify(itr, _self, [&](auto &s) {
+                s.staked += l.staked.amount;
+                s.escrow = accrued;
+                s.reward_checkpoint = reward_per_share;
+            });
+        }
+        l_itr = l_t.erase(l_itr);
+        migrated++;
+    }
+
+    eosio_assert(migrated > 0, "Nothing to migrate");
+
+    ss.active_accounts += added;
+    ss.total_shares += shares_added;
+    ss_t.set(ss, _self);
+}
+
+void token::migratelocks(const vector<name>& owners)
+{
+    require_auth(_self);
+    eosio_assert(!owners.empty(), "no accounts given");
+
+    for (const auto& owner : owners) {
+        legacy_lock_balances legacy(_self, owner.value);
+        auto l_itr = legacy.find(owner.value);
+        if (l_itr == legacy.end()) {
+            continue;
+        }
+
+        lock_tranche moved{ l_itr->locked_balance.amount, l_itr->refund_due };
+        if (moved.amount > 0) {
+            lock_balances lockbalances(_self, owner.value);
+            auto ac = lockbalances.find(BRM_SYMBOL.code().raw());
+            if (ac == lockbalances.end()) {
+                lockbalances.emplace(_self, [&](auto &row) {
+                    row.tranches.push_back(moved);
+                });
+            } else {
+                lockbalances.modify(ac, _self, [&](auto &row) {
+                    auto pos = std::upper_bound(row.tranches.begin(), row.tranches.end(), moved, [](const auto& a, const auto& b) {
+                        return a.due < b.due;
+                    });
+                    row.tranches.insert(pos, moved);
+                    if (row.tranches.size() > MAX_LOCK_TRANCHES) {
+                        auto last = row.tranches.back();
+                        row.tranches.pop_back();
+                        row.tranches.back().amount += last.amount;
+                        row.tranches.back().due = last.due;
+                    }
+                });
+            }
+        }
+
+        legacy.erase(l_itr);
+    }
 }
 
 void token::unlock_balance(name owner) {
@@ -372,7 +1001,7 @@ void token::unlock_balance(name owner) {
    //remove from lock
 
    lock_balances lockbalances(_self, owner.value);
-   auto ac = lockbalances.find(owner.value);
+   auto ac = lockbalances.find(BRM_SYMBOL.code().raw());
    if (ac == lockbalances.end()) {
 	return;
    }
@@ -383,38 +1012,31 @@ void token::unlock_balance(name owner) {
 }
 
 /** end of BRM stake functions **/
+#endif
 
+#ifndef BRM_NO_INVOICES
 /*** utility invoice payments */
 
 void token::sendinvoice(name from, name to, asset invoice_total, uint32_t payment_due, string descr) {
 
+    _sendinvoice(from, to, invoice_total, payment_due, descr);
+}
+
+void token::_sendinvoice(name from, name to, const asset& invoice_total, uint32_t payment_due, std::string_view descr) {
+
     require_auth(from);
     require_recipient(to);
     uinvoice_table u_t(_self, from.value);
     cinvoice_table c_t(_self, to.value);
     eosio_assert(is_account(to), "to account does not exist");
-    auto sym = invoice_total.symbol.code();
-    stats statstable(_self, sym.raw());
-    const auto &st = statstable.get(sym.raw());
     eosio_assert(invoice_total.is_valid(), "invalid amount");
     eosio_assert(invoice_total.amount > 0, "invoice amount must be positive");
-    eosio_assert(invoice_total.symbol == st.supply.symbol, "symbol precision mismatch");
+    check_symbol(invoice_total.symbol);
     eosio_assert(payment_due <= now(), "Invalid payment due.");
     //eosio_assert(itr == s_t.end(), "Account already has a stake. Must unstake first.");
 	
-    //uint64_t	invoice_id = u_t.available_primary_key();
-
-    uint64_t invoice_id = 0;
-    auto size = transaction_size();
-    char buf[size];
-    uint32_t read = read_transaction( buf, size );
-    eosio_assert( size == read, "read_transaction failed");
-    capi_checksum256 h;
-    sha256(buf, read, &h);
-    for(int i=0; i<4; i++) {
-      invoice_id <<=8;
-      invoice_id |= h.hash[i];
-    }
+    uint64_t invoice_id = next_invoice_id();
+    uint64_t descr_key = intern_descr(descr);
 
     auto idx = u_t.emplace(_self, [&](auto &inv) {
 	inv.invoice_id_key = invoice_id;
@@ -422,10 +1044,9 @@ void token::sendinvoice(name from, name to, asset invoice_total, uint32_t paymen
 	inv.to_account	= to;
 	inv.invoice_total = invoice_total;
 	inv.payment_due = payment_due;
-	inv.invoice_descr = descr;
 	inv.invoice_status = BRM_INVOICE_STATUS_OPEN;
+	inv.descr_key = descr_key;
     });
-    
 	
     c_t.emplace(_self, [&](auto &in) {
         in.invoice_id_key = invoice_id;
@@ -433,7 +1054,7 @@ void token::sendinvoice(name from, name to, asset invoice_total, uint32_t paymen
 	in.sender	= from;
     });
 
-    _notify(name("sendinvoice"),  "New Invoice has been sent", *idx);
+    _notify(name("sendinvoice"),  "New Invoice has been sent", *idx, "");
 }
 
 /***** Pay invoice **************************/
@@ -443,12 +1064,9 @@ void token::payinvoice(name payer, uint64_t invoice_id, asset invoice_total ) {
     require_auth(payer);
     cinvoice_table u_t(_self, payer.value);
     eosio_assert(is_account(payer), "payer account does not exist");
-    auto sym = invoice_total.symbol.code();
-    stats statstable(_self, sym.raw());
-    const auto &st = statstable.get(sym.raw());
     eosio_assert(invoice_total.is_valid(), "invalid amount");
     eosio_assert(invoice_total.amount > 0, "invoice amount must be positive");
-    eosio_assert(invoice_total.symbol == st.supply.symbol, "symbol precision mismatch");
+    check_symbol(invoice_total.symbol);
     //eosio_assert(itr == s_t.end(), "Account already has a stake. Must unstake first.");
 
 
@@ -466,33 +1084,22 @@ void token::payinvoice(name payer, uint64_t invoice_id, asset invoice_total ) {
 
     eosio_assert(midx.invoice_status == BRM_INVOICE_STATUS_OPEN, "Invoice is already paid/rejected");
 
-    SEND_INLINE_ACTION( *this, transfer, { {payer, "active"_n} },
-                          { payer, midx.from_account, invoice_total, "Paid" }
-    );
+    sub_balance(payer, invoice_total);
+    add_balance(midx.from_account, invoice_total, payer);
+    require_recipient(midx.from_account);
 
-    uint64_t payment_id = 0; 
-    auto size = transaction_size();
-    char buf[size];
-    uint32_t read = read_transaction( buf, size );
-    eosio_assert( size == read, "read_transaction failed");
-    capi_checksum256 h;
-    sha256(buf, read, &h);
-
-    for(int i=0; i<8; i++) {
-      payment_id <<=8;
-      payment_id |= h.hash[i];
-    }
+    uint64_t payment_id = next_payment_id();
 
     m_t.modify( minv, same_payer, [&]( auto& s ) {
        s.invoice_status = BRM_INVOICE_STATUS_PAID;
        s.payment_date = now();
        s.paid_total = invoice_total;
-       s.payment_id = std::to_string(payment_id);
+       s.payment_id = payment_id;
     });
 
     u_t.erase(inv);
 
-    _notify(name("payinvoice"),  "Invoice has been paid", midx);
+    _notify(name("payinvoice"),  "Invoice has been paid", midx, "");
 }
 
 /***** Reject invoice **************************/
@@ -514,48 +1121,608 @@ void token::rejectinvoice(name payer, uint64_t invoice_id, string reason) {
     const auto& midx = *minv;
     eosio_assert(midx.invoice_status == BRM_INVOICE_STATUS_OPEN, "Invoice is already paid/rejected");
 
+    // the reason is only kept in the notification trace, not in RAM
     m_t.modify( minv, same_payer, [&]( auto& s ) {
        s.invoice_status = BRM_INVOICE_STATUS_REJECTED;
-       s.invoice_descr = s.invoice_descr + "|reject:"+ reason;
     });
 
     u_t.erase(inv);
 
-    _notify(name("rejectinvoice"),  "Invoice has been rejected", midx);
+    _notify(name("rejectinvoice"),  "Invoice has been rejected", midx, "reject:" + reason);
 
 }
 
 
 
+/***** Purge settled invoices **************************/
+
+void token::purgeinvs(name merchant, uint32_t cutoff, uint32_t max_rows) {
+
+    // minvoices rows are paid for by the contract, so either side may clean up
+    eosio_assert(has_auth(merchant) || has_auth(_self), "missing authority of merchant");
+    eosio_assert(max_rows > 0, "max_rows must be positive");
+
+    uinvoice_table m_t(_self, merchant.value);
+    auto idx = m_t.get_index<"statusdue"_n>();
+
+    // purged rows drop out of the scanned range, so every call picks up
+    // where the previous one stopped without having to keep a cursor
+    uint32_t purged = 0;
+    for (uint8_t status : {BRM_INVOICE_STATUS_PAID, BRM_INVOICE_STATUS_REJECTED, BRM_INVOICE_STATUS_WRITEOFF}) {
+        auto itr = idx.lower_bound(uint64_t(status) << 32);
+        while (purged < max_rows && itr != idx.end() && itr->invoice_status == status && itr->payment_due < cutoff) {
+            release_descr(itr->descr_key);
+            itr = idx.erase(itr);
+            purged++;
+        }
+    }
+
+    eosio_assert(purged > 0, "Nothing to purge");
+}
+
+/***** Interned descriptions **************************/
+
+uint64_t token::intern_descr(std::string_view descr) {
+
+    if (descr.empty()) {
+        return 0;
+    }
+
+    capi_checksum256 h;
+    sha256(descr.data(), descr.size(), &h);
+    uint64_t key = 0;
+    for (int i = 0; i < 8; i++) {
+        key <<= 8;
+        key |= h.hash[i];
+    }
+
+    // 0 means no description, and a collision moves on to the next key
+    descr_table d_t(_self, _self.value);
+    for (;; key++) {
+        if (key == 0) {
+            continue;
+        }
+        auto itr = d_t.find(key);
+        if (itr == d_t.end()) {
+            d_t.emplace(_self, [&](auto &d) {
+                d.descr_key = key;
+                d.refs = 1;
+                d.text.assign(descr.data(), descr.size());
+            });
+            return key;
+        }
+        if (std::string_view(itr->text) == descr) {
+            d_t.modify(itr, same_payer, [&](auto &d) {
+                d.refs++;
+            });
+            return key;
+        }
+    }
+}
+
+void token::release_descr(uint64_t descr_key) {
+
+    if (descr_key == 0) {
+        return;
+    }
+
+    descr_table d_t(_self, _self.value);
+    auto itr = d_t.find(descr_key);
+    if (itr == d_t.end()) {
+        return;
+    }
+    if (itr->refs > 1) {
+        d_t.modify(itr, same_payer, [&](auto &d) {
+            d.refs--;
+        });
+    } else {
+        d_t.erase(itr);
+    }
+}
+
+/***** Migration to minvoices **************************/
+
+/**
+ *  moves a merchant's uinvoices rows into minvoices in bounded batches,
+ *  interning their inline description on the way. Ids are kept, so the
+ *  customers' cinvoices rows stay valid.
+ */
+
+void token::migrateinvs(name merchant, uint32_t max_rows) {
+
+    eosio_assert(has_auth(merchant) || has_auth(_self), "missing authority of merchant");
+    eosio_assert(max_rows > 0, "max_rows must be positive");
+
+    legacy_uinvoice_table l_t(_self, merchant.value);
+    uinvoice_table m_t(_self, merchant.value);
+
+    uint32_t migrated = 0;
+    auto l_itr = l_t.begin();
+    while (l_itr != l_t.end() && migrated < max_rows) {
+        const auto& l = *l_itr;
+        uint64_t descr_key = intern_descr(l.invoice_descr);
+
+        m_t.emplace(_self, [&](auto &inv) {
+            inv.invoice_id_key = l.invoice_id_key;
+            inv.invoice_status = l.invoice_status;
+            inv.from_account = l.from_account;
+            inv.to_account = l.to_account;
+            inv.invoice_total = l.invoice_total;
+            inv.paid_total = l.paid_total;
+            inv.payment_due = l.payment_due;
+            inv.payment_date = l.payment_date;
+            inv.payment_id = parse_payment_id(l.payment_id);
+            inv.descr_key = descr_key;
+        });
+        l_itr = l_t.erase(l_itr);
+        migrated++;
+    }
+
+    eosio_assert(migrated > 0, "Nothing to migrate");
+}
+
+/***** Allowances and merchant side collection **************************/
+
+void token::setallowance(name customer, name merchant, asset cap, uint32_t period) {
+
+    require_auth(customer);
+    eosio_assert(is_account(merchant), "merchant account does not exist");
+    eosio_assert(customer != merchant, "cannot authorize self");
+    eosio_assert(cap.is_valid(), "invalid cap");
+    eosio_assert(cap.amount > 0, "cap must be positive");
+    check_symbol(cap.symbol);
+
+    allowance_table a_t(_self, customer.value);
+    auto itr = a_t.find(merchant.value);
+    if (itr == a_t.end()) {
+        a_t.emplace(customer, [&](auto &a) {
+            a.merchant = merchant;
+            a.cap = cap;
+            a.spent = asset(0, cap.symbol);
+            a.period = period;
+            a.period_start = now();
+        });
+    } else {
+        // changing the terms starts a fresh period
+        a_t.modify(itr, customer, [&](auto &a) {
+            a.cap = cap;
+            a.spent = asset(0, cap.symbol);
+            a.period = period;
+            a.period_start = now();
+        });
+    }
+}
+
+void token::delallowance(name customer, name merchant) {
+
+    require_auth(customer);
+    allowance_table a_t(_self, customer.value);
+    const auto& a = a_t.get(merchant.value, "no allowance for this merchant");
+    a_t.erase(a);
+}
+
+/**
+ *  walks the merchant's open invoices in due order and pays each one the
+ *  customer has pre-approved, all under the merchant's signature. Invoices
+ *  without a matching allowance, over the cap or over the customer's
+ *  balance are left open and counted against max_rows, so a caller that
+ *  keeps hitting them moves from_due past them.
+ */
+
+void token::collectinvs(name merchant, uint32_t from_due, uint32_t max_rows) {
+
+    require_auth(merchant);
+    eosio_assert(max_rows > 0, "max_rows must be positive");
+
+    uinvoice_table m_t(_self, merchant.value);
+    auto idx = m_t.get_index<"statusdue"_n>();
+    id_counter_table ids(_self, _self.value);
+    auto counter = ids.get_or_default();
+    uint32_t now_ts = now();
+
+    uint32_t scanned = 0;
+    uint32_t collected = 0;
+    auto itr = idx.lower_bound((uint64_t(BRM_INVOICE_STATUS_OPEN) << 32) | from_due);
+    while (scanned < max_rows && itr != idx.end() && itr->invoice_status == BRM_INVOICE_STATUS_OPEN) {
+        auto next = itr;
+        ++next;
+        scanned++;
+
+        const name customer = itr->to_account;
+        const asset total = itr->invoice_total;
+        if (charge_allowance(customer, merchant, total, 1, now_ts) == 0) {
+            itr = next;
+            continue;
+        }
+
+        cinvoice_table c_t(_self, customer.value);
+        auto cinv = c_t.find(itr->invoice_id_key);
+        if (cinv != c_t.end()) {
+            c_t.erase(cinv);
+        }
+
+        idx.modify(itr, same_payer, [&](auto &s) {
+            s.invoice_status = BRM_INVOICE_STATUS_PAID;
+            s.payment_date = now_ts;
+            s.paid_total = total;
+            s.payment_id = counter.next_payment_id++;
+        });
+        _notify(name("payinvoice"), "Invoice has been collected", *itr, "");
+
+        itr = next;
+        collected++;
+    }
+
+    eosio_assert(collected > 0, "Nothing to collect");
+    ids.set(counter, _self);
+}
+
+/**
+ *  takes up to units times unit from customer for merchant, as far as the
+ *  allowance left in the current period and the customer's balance cover
+ *  it. Returns the number of units taken, 0 when nothing fits.
+ */
+
+uint32_t token::charge_allowance(name customer, name merchant, const asset& unit, uint32_t units, uint32_t now_ts) {
+
+    allowance_table a_t(_self, customer.value);
+    auto a = a_t.find(merchant.value);
+    if (a == a_t.end() || a->cap.symbol != unit.symbol) {
+        return 0;
+    }
+
+    uint32_t start = a->period_start;
+    int64_t spent = a->spent.amount;
+    if (a->period > 0 && now_ts - start >= a->period) {
+        start += (now_ts - start) / a->period * a->period;
+        spent = 0;
+    }
+
+    accounts c_acnts(_self, customer.value);
+    auto bal = c_acnts.find(unit.symbol.code().raw());
+    if (bal == c_acnts.end()) {
+        return 0;
+    }
+    int64_t room = std::min(a->cap.amount - spent, bal->balance.amount);
+    uint32_t taken = room < unit.amount ? 0 : static_cast<uint32_t>(std::min<int64_t>(units, room / unit.amount));
+    if (taken == 0) {
+        return 0;
+    }
+
+    asset total(unit.amount * taken, unit.symbol);
+    a_t.modify(a, same_payer, [&](auto &r) {
+        r.period_start = start;
+        r.spent.amount = spent + total.amount;
+    });
+
+    sub_balance(customer, total);
+    add_balance(merchant, total, merchant);
+    return taken;
+}
+
+/***** Recurring invoices **************************/
+
+void token::sendrecurring(name from, name to, asset amount, uint32_t period, uint32_t first_due, string descr) {
+
+    require_auth(from);
+    require_recipient(to);
+    eosio_assert(is_account(to), "to account does not exist");
+    eosio_assert(amount.is_valid(), "invalid amount");
+    eosio_assert(amount.amount > 0, "invoice amount must be positive");
+    check_symbol(amount.symbol);
+    eosio_assert(period > 0, "period must be positive");
+    eosio_assert(period <= MAX_RECURRING_PERIOD, "period must not exceed a year");
+    eosio_assert(first_due >= now(), "first_due must not be in the past");
+
+    uint64_t template_id = next_invoice_id();
+    uint64_t descr_key = intern_descr(descr);
+
+    recurring_table r_t(_self, from.value);
+    r_t.emplace(_self, [&](auto &r) {
+        r.template_id = template_id;
+        r.to_account = to;
+        r.amount = amount;
+        r.period = period;
+        r.next_due = first_due;
+        r.payment_id = 0;
+        r.descr_key = descr_key;
+    });
+
+    cinvoice_table c_t(_self, to.value);
+    c_t.emplace(_self, [&](auto &in) {
+        in.invoice_id_key = template_id;
+        in.created_date = now();
+        in.sender = from;
+    });
+
+    _notify(name("sendinvoice"), "New recurring invoice has been sent", template_id, from, to, amount, first_due, descr_key, "");
+}
+
+void token::payrecurring(name payer, uint64_t template_id, uint32_t max_periods) {
+
+    require_auth(payer);
+    eosio_assert(max_periods > 0, "max_periods must be positive");
+
+    cinvoice_table c_t(_self, payer.value);
+    const auto& cinv = c_t.get(template_id, "Account has no such invoice");
+    name merchant = cinv.sender;
+    recurring_table r_t(_self, merchant.value);
+    const auto& r = r_t.get(template_id, "Recurring invoice not found");
+
+    uint32_t periods = std::min(periods_due(r, now()), max_periods);
+    eosio_assert(periods > 0, "Nothing is due");
+    eosio_assert(r.amount.amount <= asset::max_amount / periods, "invoice total overflow");
+    asset total(r.amount.amount * periods, r.amount.symbol);
+
+    sub_balance(payer, total);
+    add_balance(merchant, total, payer);
+    require_recipient(merchant);
+
+    uint32_t next_due = advance_due(r, periods);
+    uint32_t paid_due = next_due - r.period;
+    r_t.modify(r, same_payer, [&](auto &s) {
+        s.next_due = next_due;
+        s.payment_id = next_payment_id();
+    });
+
+    _notify(name("payinvoice"), "Recurring invoice has been paid", template_id, merchant, payer, total, paid_due, r.descr_key, "");
+}
+
+void token::collectrecur(name merchant, uint32_t from_due, uint32_t max_rows) {
+
+    require_auth(merchant);
+    eosio_assert(max_rows > 0, "max_rows must be positive");
+
+    recurring_table r_t(_self, merchant.value);
+    auto idx = r_t.get_index<"nextdue"_n>();
+    id_counter_table ids(_self, _self.value);
+    auto counter = ids.get_or_default();
+    uint32_t now_ts = now();
+
+    // same walk as collectinvs over the templates whose oldest unpaid
+    // period is due, each settles as many periods as the allowance covers
+    uint32_t scanned = 0;
+    uint32_t collected = 0;
+    auto itr = idx.lower_bound(from_due);
+    while (scanned < max_rows && itr != idx.end() && itr->next_due <= now_ts) {
+        auto next = itr;
+        ++next;
+        scanned++;
+
+        uint32_t periods = charge_allowance(itr->to_account, merchant, itr->amount, periods_due(*itr, now_ts), now_ts);
+        if (periods == 0) {
+            itr = next;
+            continue;
+        }
+
+        asset total(itr->amount.amount * periods, itr->amount.symbol);
+        uint32_t next_due = advance_due(*itr, periods);
+        uint32_t paid_due = next_due - itr->period;
+        idx.modify(itr, same_payer, [&](auto &s) {
+            s.next_due = next_due;
+            s.payment_id = counter.next_payment_id++;
+        });
+        _notify(name("payinvoice"), "Recurring invoice has been collected", itr->template_id, merchant, itr->to_account, total, paid_due, itr->descr_key, "");
+
+        itr = next;
+        collected++;
+    }
+
+    eosio_assert(collected > 0, "Nothing to collect");
+    ids.set(counter, _self);
+}
+
+void token::endrecurring(name merchant, uint64_t template_id) {
+
+    recurring_table r_t(_self, merchant.value);
+    const auto& r = r_t.get(template_id, "Recurring invoice not found");
+    // either side may stop the billing, periods not yet paid are dropped
+    eosio_assert(has_auth(merchant) || has_auth(r.to_account), "missing authority of merchant or customer");
+
+    cinvoice_table c_t(_self, r.to_account.value);
+    auto cinv = c_t.find(template_id);
+    if (cinv != c_t.end()) {
+        c_t.erase(cinv);
+    }
+
+    release_descr(r.descr_key);
+
+    _notify(name("rejectinvoice"), "Recurring invoice has been ended", template_id, merchant, r.to_account, r.amount, r.next_due, r.descr_key, "");
+    r_t.erase(r);
+}
+
+uint64_t token::next_invoice_id() {
+
+    id_counter_table ids(_self, _self.value);
+    auto counter = ids.get_or_default();
+    uint64_t id = counter.next_invoice_id++;
+    ids.set(counter, _self);
+    return id;
+}
+
+uint64_t token::next_payment_id() {
+
+    id_counter_table ids(_self, _self.value);
+    auto counter = ids.get_or_default();
+    uint64_t id = counter.next_payment_id++;
+    ids.set(counter, _self);
+    return id;
+}
+
 /*** utility invoice payments */
-// inline notifications
+// inline notifications. The description travels as its descrs key,
+// note carries per event text such as a rejection reason
 struct invoice_notification_abi {
     name        invoice_status;
     string      message;
     uint64_t    invoice_id;
     name        created_by;
-    string      description;
+    uint64_t    descr_key;
+    string      note;
     asset       quantity;
     uint32_t    payment_due;
 };
 
 // leave a trace in history
-void token::_notify(name invoice_status, const string message, const utility_invoice& d)
+void token::_notify(name invoice_status, const string message, const utility_invoice& d, const string& note)
+  {
+    _notify(invoice_status, message, d.invoice_id_key, d.from_account, d.to_account, d.invoice_total, d.payment_due, d.descr_key, note);
+  }
+
+void token::_notify(name invoice_status, const string message, uint64_t invoice_id, name from, name to,
+                    const asset& quantity, uint32_t payment_due, uint64_t descr_key, const string& note)
   {
     action {
       permission_level{_self, name("active")},
-      d.to_account,
+      to,
       name("notify"),
       invoice_notification_abi {
         .invoice_status=invoice_status,
         .message=message,
-        .invoice_id=d.invoice_id_key, .created_by=d.from_account, .description=d.invoice_descr,
-        .quantity=d.invoice_total,
-        .payment_due=d.payment_due }
+        .invoice_id=invoice_id, .created_by=from,
+        .descr_key=descr_key, .note=note,
+        .quantity=quantity,
+        .payment_due=payment_due }
     }.send();
   }
 
 
+#endif
+
+/** in place dispatch
+ *
+ *  execute_action unpacks every argument into owned objects, so each memo
+ *  and description is heap allocated and copied first. The actions below
+ *  are decoded straight from the action data buffer instead, strings are
+ *  handed on as views into it and only copied when they get stored.
+ */
+
+namespace {
+
+   std::string_view read_string_view( datastream<const char*>& ds ) {
+      unsigned_int size;
+      ds >> size;
+      eosio_assert( size.value <= ds.remaining(), "read" );
+      std::string_view str( ds.pos(), size.value );
+      ds.skip( size.value );
+      return str;
+   }
+
+   template<typename Handler>
+   void with_action_data( Handler&& handler ) {
+      // same buffer strategy as execute_action
+      constexpr size_t max_stack_buffer_size = 512;
+      size_t size = action_data_size();
+      char* buffer = nullptr;
+      if( size > 0 ) {
+         buffer = static_cast<char*>( max_stack_buffer_size < size ? malloc( size ) : alloca( size ) );
+         read_action_data( buffer, size );
+      }
+      datastream<const char*> ds( buffer, size );
+      handler( ds );
+      if( max_stack_buffer_size < size ) {
+         free( buffer );
+      }
+   }
+
+}
+
+bool token::dispatch_in_place( name receiver, name code, name action )
+{
+   switch( action.value ) {
+      case "transfer"_n.value:
+         with_action_data( [&]( auto& ds ) {
+            name from, to;
+            asset quantity;
+            ds >> from >> to >> quantity;
+            auto memo = read_string_view( ds );
+            token( receiver, code, ds )._transfer( from, to, quantity, memo );
+         });
+         return true;
+      case "issue"_n.value:
+         with_action_data( [&]( auto& ds ) {
+            name to;
+            asset quantity;
+            ds >> to >> quantity;
+            auto memo = read_string_view( ds );
+            token( receiver, code, ds )._issue( to, quantity, memo );
+         });
+         return true;
+      case "retire"_n.value:
+         with_action_data( [&]( auto& ds ) {
+            asset quantity;
+            ds >> quantity;
+            auto memo = read_string_view( ds );
+            token( receiver, code, ds )._retire( quantity, memo );
+         });
+         return true;
+#ifndef BRM_NO_INVOICES
+      case "sendinvoice"_n.value:
+         with_action_data( [&]( auto& ds ) {
+            name from, to;
+            asset invoice_total;
+            uint32_t payment_due;
+            ds >> from >> to >> invoice_total >> payment_due;
+            auto descr = read_string_view( ds );
+            token( receiver, code, ds )._sendinvoice( from, to, invoice_total, payment_due, descr );
+         });
+         return true;
+#endif
+   }
+   return false;
+}
+
 } /// namespace eosio
 
-EOSIO_DISPATCH( eosio::token, (create)(issue)(transfer)(open)(close)(retire)(stake)(unstake)(refund)(sendinvoice)(payinvoice)(rejectinvoice))
+#define TOKEN_ACTION( member ) \
+   case eosio::name( #member ).value: \
+      eosio::execute_action( eosio::name(receiver), eosio::name(code), &eosio::token::member ); \
+      break;
+
+extern "C" {
+   void apply( uint64_t receiver, uint64_t code, uint64_t action ) {
+      if( code != receiver ) {
+         return;
+      }
+      if( eosio::token::dispatch_in_place( eosio::name(receiver), eosio::name(code), eosio::name(action) ) ) {
+         return;
+      }
+      switch( action ) {
+         TOKEN_ACTION( create )
+         TOKEN_ACTION( issuemany )
+         TOKEN_ACTION( transferc )
+         TOKEN_ACTION( transfermany )
+         TOKEN_ACTION( open )
+         TOKEN_ACTION( close )
+         TOKEN_ACTION( closemany )
+         TOKEN_ACTION( allowsweep )
+         TOKEN_ACTION( sweep )
+#ifndef BRM_NO_STAKING
+         TOKEN_ACTION( stake )
+         TOKEN_ACTION( unstake )
+         TOKEN_ACTION( refund )
+         TOKEN_ACTION( refundmany )
+         TOKEN_ACTION( distribute )
+         TOKEN_ACTION( claimreward )
+         TOKEN_ACTION( getpositions )
+         TOKEN_ACTION( audit )
+         TOKEN_ACTION( splitconfig )
+         TOKEN_ACTION( migratestake )
+         TOKEN_ACTION( migratelocks )
+#endif
+#ifndef BRM_NO_INVOICES
+         TOKEN_ACTION( payinvoice )
+         TOKEN_ACTION( rejectinvoice )
+         TOKEN_ACTION( purgeinvs )
+         TOKEN_ACTION( migrateinvs )
+         TOKEN_ACTION( setallowance )
+         TOKEN_ACTION( delallowance )
+         TOKEN_ACTION( collectinvs )
+         TOKEN_ACTION( sendrecurring )
+         TOKEN_ACTION( payrecurring )
+         TOKEN_ACTION( collectrecur )
+         TOKEN_ACTION( endrecurring )
+#endif
+      }
+   }
+}
@@ -0,0 +1,111 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ */
+#pragma once
+
+#include "datastream.hpp"
+#include "name.hpp"
+#include "serialize.hpp"
+
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+namespace eosio {
+
+   inline name current_receiver() {
+      return name{ ::current_receiver() };
+   }
+
+   inline void require_auth( name n ) {
+      ::require_auth( n.value );
+   }
+
+   inline bool has_auth( name n ) {
+      return ::has_auth( n.value );
+   }
+
+   inline bool is_account( name n ) {
+      return ::is_account( n.value );
+   }
+
+   inline void require_recipient( name notify_account ) {
+      ::require_recipient( notify_account.value );
+   }
+
+   template<typename... accounts>
+   void require_recipient( name notify_account, accounts... remaining_accounts ) {
+      ::require_recipient( notify_account.value );
+      require_recipient( remaining_accounts... );
+   }
+
+   template<typename T>
+   T unpack_action_data() {
+      std::vector<char> buffer( action_data_size() );
+      read_action_data( buffer.data(), buffer.size() );
+      return unpack<T>( buffer.data(), buffer.size() );
+   }
+
+   struct permission_level {
+      permission_level( name a, name p ) : actor(a), permission(p) {}
+      permission_level() {}
+
+      name actor;
+      name permission;
+
+      friend constexpr bool operator == ( const permission_level& a, const permission_level& b ) {
+         return a.actor == b.actor && a.permission == b.permission;
+      }
+
+      EOSLIB_SERIALIZE( permission_level, (actor)(permission) )
+   };
+
+   // inline actions are recorded in the chain's sent list, not executed
+   struct action {
+      struct name                   account;
+      struct name                   name;
+      std::vector<permission_level> authorization;
+      std::vector<char>             data;
+
+      action() = default;
+
+      template<typename T>
+      action( const permission_level& auth, struct name a, struct name n, T&& value )
+      : account(a), name(n), authorization(1, auth), data(pack(std::forward<T>(value))) {}
+
+      template<typename T>
+      action( std::vector<permission_level> auths, struct name a, struct name n, T&& value )
+      : account(a), name(n), authorization(std::move(auths)), data(pack(std::forward<T>(value))) {}
+
+      EOSLIB_SERIALIZE( action, (account)(name)(authorization)(data) )
+
+      void send()const {
+         eosio_test::sent_action sent{ account.value, name.value, {}, data };
+         for( const auto& p : authorization ) {
+            sent.authorization.emplace_back( p.actor.value, p.permission.value );
+         }
+         eosio_test::chain().sent.push_back( std::move(sent) );
+      }
+
+      template<typename T>
+      T data_as() {
+         return unpack<T>( data.data(), data.size() );
+      }
+   };
+
+   // SEND_INLINE_ACTION packs the arguments as the member's parameter types
+   template<typename>
+   struct inline_dispatcher;
+
+   template<typename T, typename... Args>
+   struct inline_dispatcher<void (T::*)(Args...)> {
+      static void call( name code, name act, std::vector<permission_level> perms, std::tuple<std::decay_t<Args>...> args ) {
+         action( std::move(perms), code, act, std::move(args) ).send();
+      }
+   };
+
+}
+
+#define SEND_INLINE_ACTION( CONTRACT, NAME, ... ) \
+   ::eosio::inline_dispatcher<decltype(&std::decay_t<decltype(CONTRACT)>::NAME)>::call( (CONTRACT).get_self(), ::eosio::name(#NAME), __VA_ARGS__ )
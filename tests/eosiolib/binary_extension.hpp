@@ -0,0 +1,76 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ */
+#pragma once
+
+#include "datastream.hpp"
+
+#include <optional>
+
+namespace eosio {
+
+   /**
+    *  Trailing field that may be missing from rows packed before it was
+    *  added: unpacking stops at the end of the data and leaves it empty.
+    */
+   template <typename T>
+   class binary_extension {
+      public:
+         using value_type = T;
+
+         constexpr binary_extension() {}
+         constexpr binary_extension( const T& ext ) : _opt(ext) {}
+         constexpr binary_extension( T&& ext ) : _opt(std::move(ext)) {}
+
+         constexpr bool has_value()const { return _opt.has_value(); }
+         constexpr explicit operator bool()const { return has_value(); }
+
+         constexpr T& value() {
+            eosio_assert( has_value(), "cannot get value of empty binary_extension" );
+            return *_opt;
+         }
+         constexpr const T& value()const {
+            eosio_assert( has_value(), "cannot get value of empty binary_extension" );
+            return *_opt;
+         }
+
+         constexpr auto value_or( const T& def )const { return has_value() ? *_opt : def; }
+         constexpr auto value_or()const { return has_value() ? *_opt : T{}; }
+
+         constexpr T* operator->() { return &value(); }
+         constexpr const T* operator->()const { return &value(); }
+         constexpr T& operator*() { return value(); }
+         constexpr const T& operator*()const { return value(); }
+
+         template <typename... Args>
+         T& emplace( Args&&... args ) {
+            _opt.emplace( std::forward<Args>(args)... );
+            return *_opt;
+         }
+
+         void reset() { _opt.reset(); }
+
+      private:
+         std::optional<T> _opt;
+   };
+
+   template<typename DS, typename T>
+   DS& operator << ( DS& ds, const binary_extension<T>& be ) {
+      if( be.has_value() ) {
+         ds << be.value();
+      }
+      return ds;
+   }
+
+   template<typename DS, typename T>
+   DS& operator >> ( DS& ds, binary_extension<T>& be ) {
+      if( ds.remaining() ) {
+         T val;
+         ds >> val;
+         be.emplace( std::move(val) );
+      }
+      return ds;
+   }
+
+}
@@ -0,0 +1,27 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ */
+#pragma once
+
+#include "datastream.hpp"
+#include "name.hpp"
+
+namespace eosio {
+
+   class contract {
+      public:
+         contract( name receiver, name code, datastream<const char*> ds ) : _self(receiver), _code(code), _ds(ds) {}
+
+         inline name get_self()const { return _self; }
+         inline name get_code()const { return _code; }
+         inline datastream<const char*>& get_datastream() { return _ds; }
+         inline const datastream<const char*>& get_datastream()const { return _ds; }
+
+      protected:
+         name _self;
+         name _code;
+         datastream<const char*> _ds = datastream<const char*>(nullptr, 0);
+   };
+
+}
@@ -0,0 +1,322 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ *
+ *  datastream and the pack format, including the reflection of plain
+ *  aggregates that eosio-cpp does through boost::pfr (tables and action
+ *  structs without EOSLIB_SERIALIZE are packed field by field).
+ */
+#pragma once
+
+#include "name.hpp"
+#include "varint.hpp"
+
+#include <optional>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace eosio {
+
+   template<typename T>
+   class datastream {
+      public:
+         datastream( T start, size_t s ) : _start(start), _pos(start), _end(start + s) {}
+
+         inline void skip( size_t s ) { _pos += s; }
+
+         inline bool read( char* d, size_t s ) {
+            eosio_assert( size_t(_end - _pos) >= (size_t)s, "read" );
+            memcpy( d, _pos, s );
+            _pos += s;
+            return true;
+         }
+
+         inline bool write( const char* d, size_t s ) {
+            eosio_assert( _end - _pos >= (int32_t)s, "write" );
+            memcpy( (void*)_pos, d, s );
+            _pos += s;
+            return true;
+         }
+
+         inline T pos()const { return _pos; }
+         inline bool valid()const { return _pos <= _end && _pos >= _start; }
+         inline bool seekp( size_t p ) { _pos = _start + p; return _pos <= _end; }
+         inline size_t tellp()const { return size_t(_pos - _start); }
+         inline size_t remaining()const { return _end - _pos; }
+
+      private:
+         T _start;
+         T _pos;
+         T _end;
+   };
+
+   template<>
+   class datastream<size_t> {
+      public:
+         datastream( size_t init_size = 0 ) : _size(init_size) {}
+         inline bool skip( size_t s ) { _size += s; return true; }
+         inline bool write( const char*, size_t s ) { _size += s; return true; }
+         inline bool seekp( size_t p ) { _size = p; return true; }
+         inline size_t tellp()const { return _size; }
+         inline size_t remaining()const { return 0; }
+      private:
+         size_t _size;
+   };
+
+   namespace reflect {
+      struct any_field {
+         template<typename T> constexpr operator T()const;
+      };
+
+      template<typename T, typename Seq, typename = void>
+      struct brace_constructible : std::false_type {};
+
+      template<typename T, size_t... I>
+      struct brace_constructible<T, std::index_sequence<I...>, std::void_t<decltype(T{ (void(I), any_field{})... })>> : std::true_type {};
+
+      template<typename T, size_t N = 0>
+      constexpr size_t field_count() {
+         if constexpr( brace_constructible<T, std::make_index_sequence<N + 1>>::value )
+            return field_count<T, N + 1>();
+         else
+            return N;
+      }
+
+      template<typename T>
+      constexpr bool is_reflected_v = std::is_class_v<T> && std::is_aggregate_v<T>;
+
+      template<typename T, typename F>
+      void for_each_field( T& t, F&& f ) {
+         constexpr size_t n = field_count<std::remove_const_t<T>>();
+         static_assert( n > 0 && n <= 24, "aggregate has no or too many fields for the stub reflection" );
+      if constexpr( n == 1 ) { auto& [f0] = t; f(f0); }
+      else if constexpr( n == 2 ) { auto& [f0, f1] = t; f(f0); f(f1); }
+      else if constexpr( n == 3 ) { auto& [f0, f1, f2] = t; f(f0); f(f1); f(f2); }
+      else if constexpr( n == 4 ) { auto& [f0, f1, f2, f3] = t; f(f0); f(f1); f(f2); f(f3); }
+      else if constexpr( n == 5 ) { auto& [f0, f1, f2, f3, f4] = t; f(f0); f(f1); f(f2); f(f3); f(f4); }
+      else if constexpr( n == 6 ) { auto& [f0, f1, f2, f3, f4, f5] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); }
+      else if constexpr( n == 7 ) { auto& [f0, f1, f2, f3, f4, f5, f6] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); }
+      else if constexpr( n == 8 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); }
+      else if constexpr( n == 9 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); f(f8); }
+      else if constexpr( n == 10 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); f(f8); f(f9); }
+      else if constexpr( n == 11 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); f(f8); f(f9); f(f10); }
+      else if constexpr( n == 12 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); f(f8); f(f9); f(f10); f(f11); }
+      else if constexpr( n == 13 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); f(f8); f(f9); f(f10); f(f11); f(f12); }
+      else if constexpr( n == 14 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); f(f8); f(f9); f(f10); f(f11); f(f12); f(f13); }
+      else if constexpr( n == 15 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); f(f8); f(f9); f(f10); f(f11); f(f12); f(f13); f(f14); }
+      else if constexpr( n == 16 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); f(f8); f(f9); f(f10); f(f11); f(f12); f(f13); f(f14); f(f15); }
+      else if constexpr( n == 17 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15, f16] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); f(f8); f(f9); f(f10); f(f11); f(f12); f(f13); f(f14); f(f15); f(f16); }
+      else if constexpr( n == 18 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15, f16, f17] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); f(f8); f(f9); f(f10); f(f11); f(f12); f(f13); f(f14); f(f15); f(f16); f(f17); }
+      else if constexpr( n == 19 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15, f16, f17, f18] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); f(f8); f(f9); f(f10); f(f11); f(f12); f(f13); f(f14); f(f15); f(f16); f(f17); f(f18); }
+      else if constexpr( n == 20 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15, f16, f17, f18, f19] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); f(f8); f(f9); f(f10); f(f11); f(f12); f(f13); f(f14); f(f15); f(f16); f(f17); f(f18); f(f19); }
+      else if constexpr( n == 21 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15, f16, f17, f18, f19, f20] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); f(f8); f(f9); f(f10); f(f11); f(f12); f(f13); f(f14); f(f15); f(f16); f(f17); f(f18); f(f19); f(f20); }
+      else if constexpr( n == 22 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15, f16, f17, f18, f19, f20, f21] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); f(f8); f(f9); f(f10); f(f11); f(f12); f(f13); f(f14); f(f15); f(f16); f(f17); f(f18); f(f19); f(f20); f(f21); }
+      else if constexpr( n == 23 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15, f16, f17, f18, f19, f20, f21, f22] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); f(f8); f(f9); f(f10); f(f11); f(f12); f(f13); f(f14); f(f15); f(f16); f(f17); f(f18); f(f19); f(f20); f(f21); f(f22); }
+      else if constexpr( n == 24 ) { auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15, f16, f17, f18, f19, f20, f21, f22, f23] = t; f(f0); f(f1); f(f2); f(f3); f(f4); f(f5); f(f6); f(f7); f(f8); f(f9); f(f10); f(f11); f(f12); f(f13); f(f14); f(f15); f(f16); f(f17); f(f18); f(f19); f(f20); f(f21); f(f22); f(f23); }
+      }
+   }
+
+   // everything a packed field can be made of is declared up front, so
+   // containers find the operators of their element types
+   template<typename DS, typename T, std::enable_if_t<std::is_arithmetic_v<T>, int> = 0> DS& operator << ( DS& ds, const T& v );
+   template<typename DS, typename T, std::enable_if_t<std::is_arithmetic_v<T>, int> = 0> DS& operator >> ( DS& ds, T& v );
+   template<typename DS> DS& operator << ( DS& ds, const unsigned_int& v );
+   template<typename DS> DS& operator >> ( DS& ds, unsigned_int& v );
+   template<typename DS> DS& operator << ( DS& ds, const name& v );
+   template<typename DS> DS& operator >> ( DS& ds, name& v );
+   template<typename DS> DS& operator << ( DS& ds, const std::string& v );
+   template<typename DS> DS& operator >> ( DS& ds, std::string& v );
+   template<typename DS, typename T> DS& operator << ( DS& ds, const std::vector<T>& v );
+   template<typename DS, typename T> DS& operator >> ( DS& ds, std::vector<T>& v );
+   template<typename DS, typename A, typename B> DS& operator << ( DS& ds, const std::pair<A, B>& v );
+   template<typename DS, typename A, typename B> DS& operator >> ( DS& ds, std::pair<A, B>& v );
+   template<typename DS, typename... Ts> DS& operator << ( DS& ds, const std::tuple<Ts...>& v );
+   template<typename DS, typename... Ts> DS& operator >> ( DS& ds, std::tuple<Ts...>& v );
+   template<typename DS, typename T> DS& operator << ( DS& ds, const std::optional<T>& v );
+   template<typename DS, typename T> DS& operator >> ( DS& ds, std::optional<T>& v );
+   template<typename DS, typename T, std::enable_if_t<reflect::is_reflected_v<T>, int> = 0> DS& operator << ( DS& ds, const T& v );
+   template<typename DS, typename T, std::enable_if_t<reflect::is_reflected_v<T>, int> = 0> DS& operator >> ( DS& ds, T& v );
+
+   template<typename DS, typename T, std::enable_if_t<std::is_arithmetic_v<T>, int>>
+   DS& operator << ( DS& ds, const T& v ) {
+      ds.write( (const char*)&v, sizeof(T) );
+      return ds;
+   }
+
+   template<typename DS, typename T, std::enable_if_t<std::is_arithmetic_v<T>, int>>
+   DS& operator >> ( DS& ds, T& v ) {
+      ds.read( (char*)&v, sizeof(T) );
+      return ds;
+   }
+
+   template<typename DS>
+   DS& operator << ( DS& ds, const unsigned_int& v ) {
+      uint64_t val = v.value;
+      do {
+         uint8_t b = uint8_t(val) & 0x7f;
+         val >>= 7;
+         b |= ((val > 0) << 7);
+         ds.write( (char*)&b, 1 );
+      } while( val );
+      return ds;
+   }
+
+   template<typename DS>
+   DS& operator >> ( DS& ds, unsigned_int& v ) {
+      uint64_t val = 0;
+      char     b = 0;
+      uint8_t  by = 0;
+      do {
+         ds.read( &b, 1 );
+         val |= uint32_t(uint8_t(b) & 0x7f) << by;
+         by += 7;
+      } while( uint8_t(b) & 0x80 );
+      v.value = static_cast<uint32_t>(val);
+      return ds;
+   }
+
+   template<typename DS>
+   DS& operator << ( DS& ds, const name& v ) {
+      return ds << v.value;
+   }
+
+   template<typename DS>
+   DS& operator >> ( DS& ds, name& v ) {
+      return ds >> v.value;
+   }
+
+   template<typename DS>
+   DS& operator << ( DS& ds, const std::string& v ) {
+      ds << unsigned_int( v.size() );
+      if( v.size() ) {
+         ds.write( v.data(), v.size() );
+      }
+      return ds;
+   }
+
+   template<typename DS>
+   DS& operator >> ( DS& ds, std::string& v ) {
+      unsigned_int s;
+      ds >> s;
+      eosio_assert( s.value <= ds.remaining(), "read" );
+      v.resize( s.value );
+      if( s.value ) {
+         ds.read( v.data(), s.value );
+      }
+      return ds;
+   }
+
+   template<typename DS, typename T>
+   DS& operator << ( DS& ds, const std::vector<T>& v ) {
+      ds << unsigned_int( v.size() );
+      for( const auto& i : v ) {
+         ds << i;
+      }
+      return ds;
+   }
+
+   template<typename DS, typename T>
+   DS& operator >> ( DS& ds, std::vector<T>& v ) {
+      unsigned_int s;
+      ds >> s;
+      // every element takes at least a byte, a bogus size fails here
+      // instead of allocating it
+      eosio_assert( s.value <= ds.remaining(), "read" );
+      v.resize( s.value );
+      for( auto& i : v ) {
+         ds >> i;
+      }
+      return ds;
+   }
+
+   template<typename DS, typename A, typename B>
+   DS& operator << ( DS& ds, const std::pair<A, B>& v ) {
+      return ds << v.first << v.second;
+   }
+
+   template<typename DS, typename A, typename B>
+   DS& operator >> ( DS& ds, std::pair<A, B>& v ) {
+      return ds >> v.first >> v.second;
+   }
+
+   template<typename DS, typename... Ts>
+   DS& operator << ( DS& ds, const std::tuple<Ts...>& v ) {
+      std::apply( [&]( const auto&... e ) { ((ds << e), ...); }, v );
+      return ds;
+   }
+
+   template<typename DS, typename... Ts>
+   DS& operator >> ( DS& ds, std::tuple<Ts...>& v ) {
+      std::apply( [&]( auto&... e ) { ((ds >> e), ...); }, v );
+      return ds;
+   }
+
+   template<typename DS, typename T>
+   DS& operator << ( DS& ds, const std::optional<T>& v ) {
+      char valid = v.has_value();
+      ds << valid;
+      if( valid ) {
+         ds << *v;
+      }
+      return ds;
+   }
+
+   template<typename DS, typename T>
+   DS& operator >> ( DS& ds, std::optional<T>& v ) {
+      char valid = 0;
+      ds >> valid;
+      if( valid ) {
+         T val;
+         ds >> val;
+         v = std::move( val );
+      } else {
+         v.reset();
+      }
+      return ds;
+   }
+
+   template<typename DS, typename T, std::enable_if_t<reflect::is_reflected_v<T>, int>>
+   DS& operator << ( DS& ds, const T& v ) {
+      reflect::for_each_field( v, [&]( const auto& f ) { ds << f; } );
+      return ds;
+   }
+
+   template<typename DS, typename T, std::enable_if_t<reflect::is_reflected_v<T>, int>>
+   DS& operator >> ( DS& ds, T& v ) {
+      reflect::for_each_field( v, [&]( auto& f ) { ds >> f; } );
+      return ds;
+   }
+
+   template<typename T>
+   size_t pack_size( const T& value ) {
+      datastream<size_t> ps;
+      ps << value;
+      return ps.tellp();
+   }
+
+   template<typename T>
+   std::vector<char> pack( const T& value ) {
+      std::vector<char> result;
+      result.resize( pack_size( value ) );
+      datastream<char*> ds( result.data(), result.size() );
+      ds << value;
+      return result;
+   }
+
+   template<typename T>
+   T unpack( const char* buffer, size_t len ) {
+      T result;
+      datastream<const char*> ds( buffer, len );
+      ds >> result;
+      return result;
+   }
+
+   template<typename T>
+   T unpack( const std::vector<char>& bytes ) {
+      return unpack<T>( bytes.data(), bytes.size() );
+   }
+
+}
@@ -0,0 +1,14 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ */
+#pragma once
+
+#include "action.hpp"
+#include "contract.hpp"
+#include "dispatcher.hpp"
+#include "multi_index.hpp"
+#include "print.hpp"
+
+typedef unsigned __int128 uint128_t;
+typedef __int128 int128_t;
@@ -0,0 +1,528 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ *
+ *  multi_index over the in-memory chain. Behaves like the CDT one where the
+ *  contract can tell: every instance caches the objects it loaded and
+ *  hands out references into that cache, modify/erase only take objects of
+ *  the same instance, secondary entries live in tables of their own and
+ *  modifying a row whose secondary entry is missing fails like the
+ *  db_idx*_update of nodeos does. Secondary keys are uint64_t only.
+ */
+#pragma once
+
+#include "datastream.hpp"
+#include "name.hpp"
+#include "serialize.hpp"
+
+#include <map>
+#include <limits>
+#include <memory>
+#include <type_traits>
+
+namespace eosio {
+
+   template<name::raw IndexName, typename Extractor>
+   struct indexed_by {
+      enum constants { index_name = static_cast<uint64_t>(IndexName) };
+      typedef Extractor secondary_extractor_type;
+   };
+
+   template<class Class, typename Type, Type (Class::*PtrToMemberFunction)()const>
+   struct const_mem_fun {
+      typedef typename std::remove_cv<typename std::remove_reference<Type>::type>::type result_type;
+
+      template<typename ChainedPtr>
+      auto operator()( const ChainedPtr& x )const -> std::enable_if_t<!std::is_convertible<const ChainedPtr&, const Class&>::value, Type> {
+         return operator()( *x );
+      }
+
+      Type operator()( const Class& x )const {
+         return (x.*PtrToMemberFunction)();
+      }
+   };
+
+   template<name::raw TableName, typename T, typename... Indices>
+   class multi_index {
+      private:
+         static constexpr uint64_t table_name = static_cast<uint64_t>(TableName);
+
+         static constexpr uint64_t index_table( uint64_t number ) {
+            return (table_name & 0xFFFFFFFFFFFFFFF0ULL) | number;
+         }
+
+         template<size_t I>
+         using index_at = std::tuple_element_t<I, std::tuple<Indices...>>;
+
+         template<size_t I>
+         static uint64_t extract( const T& obj ) {
+            using extractor = typename index_at<I>::secondary_extractor_type;
+            static_assert( std::is_same<typename extractor::result_type, uint64_t>::value, "stub multi_index only supports uint64_t secondary keys" );
+            return extractor()( obj );
+         }
+
+         template<typename F, size_t... I>
+         static void for_each_index( F&& f, std::index_sequence<I...> ) {
+            (f( std::integral_constant<size_t, I>() ), ...);
+         }
+
+         template<typename F>
+         static void for_each_index( F&& f ) {
+            for_each_index( std::forward<F>(f), std::index_sequence_for<Indices...>() );
+         }
+
+         name     _code;
+         uint64_t _scope;
+         mutable std::map<uint64_t, std::unique_ptr<T>> _items;
+
+         eosio_test::table_key key()const { return eosio_test::table_key{ _code.value, _scope, table_name }; }
+         eosio_test::table_key index_key( uint64_t number )const { return eosio_test::table_key{ _code.value, _scope, index_table(number) }; }
+
+         const std::map<uint64_t, eosio_test::stored_row>* rows()const {
+            auto& tables = eosio_test::chain().tables;
+            auto it = tables.find( key() );
+            return it == tables.end() ? nullptr : &it->second;
+         }
+
+         const eosio_test::secondary_rows* index_rows( uint64_t number )const {
+            auto& indexes = eosio_test::chain().indexes;
+            auto it = indexes.find( index_key(number) );
+            return it == indexes.end() ? nullptr : &it->second;
+         }
+
+         const T* load( uint64_t pk )const {
+            auto c = _items.find( pk );
+            if( c != _items.end() ) {
+               return c->second.get();
+            }
+            eosio_test::chain().db_reads++;
+            auto r = rows();
+            if( !r ) {
+               return nullptr;
+            }
+            auto it = r->find( pk );
+            if( it == r->end() ) {
+               return nullptr;
+            }
+            auto obj = std::make_unique<T>();
+            datastream<const char*> ds( it->second.data.data(), it->second.data.size() );
+            ds >> *obj;
+            return ( _items[pk] = std::move(obj) ).get();
+         }
+
+         const T* load_at( std::map<uint64_t, eosio_test::stored_row>::const_iterator it )const {
+            auto r = rows();
+            return (!r || it == r->end()) ? nullptr : load( it->first );
+         }
+
+         const T* next_item( uint64_t pk )const {
+            auto r = rows();
+            return r ? load_at( r->upper_bound( pk ) ) : nullptr;
+         }
+
+         const T* prev_item( uint64_t pk )const {
+            auto r = rows();
+            if( !r ) {
+               return nullptr;
+            }
+            auto it = r->lower_bound( pk );
+            if( it == r->begin() ) {
+               return nullptr;
+            }
+            return load( (--it)->first );
+         }
+
+         const T* last_item()const {
+            auto r = rows();
+            if( !r || r->empty() ) {
+               return nullptr;
+            }
+            return load( r->rbegin()->first );
+         }
+
+         void check_owned( const T& obj, const char* msg )const {
+            auto it = _items.find( obj.primary_key() );
+            eosio_assert( it != _items.end() && it->second.get() == &obj, msg );
+         }
+
+      public:
+         struct const_iterator {
+            const T& operator*()const {
+               eosio_assert( _item != nullptr, "cannot dereference end iterator" );
+               return *_item;
+            }
+            const T* operator->()const {
+               eosio_assert( _item != nullptr, "cannot dereference end iterator" );
+               return _item;
+            }
+
+            const_iterator& operator++() {
+               eosio_assert( _item != nullptr, "cannot increment end iterator" );
+               _item = _multidx->next_item( _item->primary_key() );
+               return *this;
+            }
+            const_iterator operator++( int ) {
+               const_iterator result( *this );
+               ++(*this);
+               return result;
+            }
+
+            const_iterator& operator--() {
+               _item = _item ? _multidx->prev_item( _item->primary_key() ) : _multidx->last_item();
+               eosio_assert( _item != nullptr, "cannot decrement iterator at beginning of table" );
+               return *this;
+            }
+            const_iterator operator--( int ) {
+               const_iterator result( *this );
+               --(*this);
+               return result;
+            }
+
+            friend bool operator == ( const const_iterator& a, const const_iterator& b ) { return a._item == b._item; }
+            friend bool operator != ( const const_iterator& a, const const_iterator& b ) { return a._item != b._item; }
+
+            const_iterator() {}
+
+         private:
+            friend class multi_index;
+            const_iterator( const multi_index* mi, const T* i = nullptr ) : _multidx(mi), _item(i) {}
+
+            const multi_index* _multidx = nullptr;
+            const T*           _item = nullptr;
+         };
+
+         template<uint64_t IndexName, uint64_t Number>
+         struct index {
+            public:
+               struct const_iterator {
+                  const T& operator*()const {
+                     eosio_assert( _item != nullptr, "cannot dereference end iterator" );
+                     return *_item;
+                  }
+                  const T* operator->()const {
+                     eosio_assert( _item != nullptr, "cannot dereference end iterator" );
+                     return _item;
+                  }
+
+                  // steps from where the object's secondary entry is now,
+                  // like db_idx64_next from the object's index iterator
+                  const_iterator& operator++() {
+                     eosio_assert( _item != nullptr, "cannot increment end iterator" );
+                     auto s = _multidx->index_rows( Number );
+                     eosio_assert( s != nullptr, "dereference of end iterator" );
+                     auto pk = _item->primary_key();
+                     auto e = s->by_primary.find( pk );
+                     eosio_assert( e != s->by_primary.end(), "dereference of end iterator" );
+                     auto n = s->by_secondary.upper_bound( { e->second, pk } );
+                     _item = n == s->by_secondary.end() ? nullptr : _multidx->load( n->second );
+                     return *this;
+                  }
+                  const_iterator operator++( int ) {
+                     const_iterator result( *this );
+                     ++(*this);
+                     return result;
+                  }
+
+                  const_iterator& operator--() {
+                     auto s = _multidx->index_rows( Number );
+                     eosio_assert( s != nullptr && !s->by_secondary.empty(), "cannot decrement iterator at beginning of index" );
+                     if( !_item ) {
+                        _item = _multidx->load( s->by_secondary.rbegin()->second );
+                        return *this;
+                     }
+                     auto pk = _item->primary_key();
+                     auto e = s->by_primary.find( pk );
+                     eosio_assert( e != s->by_primary.end(), "dereference of end iterator" );
+                     auto p = s->by_secondary.lower_bound( { e->second, pk } );
+                     eosio_assert( p != s->by_secondary.begin(), "cannot decrement iterator at beginning of index" );
+                     _item = _multidx->load( (--p)->second );
+                     return *this;
+                  }
+
+                  friend bool operator == ( const const_iterator& a, const const_iterator& b ) { return a._item == b._item; }
+                  friend bool operator != ( const const_iterator& a, const const_iterator& b ) { return a._item != b._item; }
+
+                  const_iterator() {}
+
+               private:
+                  friend struct index;
+                  const_iterator( const multi_index* mi, const T* i = nullptr ) : _multidx(mi), _item(i) {}
+
+                  const multi_index* _multidx = nullptr;
+                  const T*           _item = nullptr;
+               };
+
+               static constexpr uint64_t name() { return index_table( Number ); }
+               static constexpr uint64_t number() { return Number; }
+
+               const_iterator begin()const {
+                  auto s = _multidx->index_rows( Number );
+                  if( !s || s->by_secondary.empty() ) {
+                     return end();
+                  }
+                  return const_iterator( _multidx, _multidx->load( s->by_secondary.begin()->second ) );
+               }
+               const_iterator cbegin()const { return begin(); }
+               const_iterator end()const { return const_iterator( _multidx ); }
+               const_iterator cend()const { return end(); }
+
+               const_iterator lower_bound( uint64_t secondary )const {
+                  auto s = _multidx->index_rows( Number );
+                  if( !s ) {
+                     return end();
+                  }
+                  auto it = s->by_secondary.lower_bound( { secondary, 0 } );
+                  return it == s->by_secondary.end() ? end() : const_iterator( _multidx, _multidx->load( it->second ) );
+               }
+
+               const_iterator upper_bound( uint64_t secondary )const {
+                  auto s = _multidx->index_rows( Number );
+                  if( !s ) {
+                     return end();
+                  }
+                  auto it = s->by_secondary.upper_bound( { secondary, std::numeric_limits<uint64_t>::max() } );
+                  return it == s->by_secondary.end() ? end() : const_iterator( _multidx, _multidx->load( it->second ) );
+               }
+
+               const_iterator find( uint64_t secondary )const {
+                  auto itr = lower_bound( secondary );
+                  if( itr == end() || extract<Number>( *itr ) != secondary ) {
+                     return end();
+                  }
+                  return itr;
+               }
+
+               const T& get( uint64_t secondary, const char* error_msg = "unable to find secondary key" )const {
+                  auto result = find( secondary );
+                  eosio_assert( result != end(), error_msg );
+                  return *result;
+               }
+
+               const_iterator iterator_to( const T& obj )const {
+                  _multidx->check_owned( obj, "object passed to iterator_to is not in multi_index" );
+                  return const_iterator( _multidx, &obj );
+               }
+
+               template<typename Lambda>
+               void modify( const_iterator itr, eosio::name payer, Lambda&& updater ) {
+                  eosio_assert( itr != end(), "cannot pass end iterator to modify" );
+                  const_cast<multi_index*>(_multidx)->modify( *itr, payer, std::forward<Lambda&&>(updater) );
+               }
+
+               const_iterator erase( const_iterator itr ) {
+                  eosio_assert( itr != end(), "cannot pass end iterator to erase" );
+                  const auto& obj = *itr;
+                  ++itr;
+                  const_cast<multi_index*>(_multidx)->erase( obj );
+                  return itr;
+               }
+
+               eosio::name get_code()const { return _multidx->get_code(); }
+               uint64_t get_scope()const { return _multidx->get_scope(); }
+
+            private:
+               friend class multi_index;
+               index( const multi_index* midx ) : _multidx(midx) {}
+
+               const multi_index* _multidx;
+         };
+
+         multi_index( name code, uint64_t scope ) : _code(code), _scope(scope) {}
+
+         multi_index( const multi_index& ) = delete;
+         multi_index& operator=( const multi_index& ) = delete;
+
+         name get_code()const { return _code; }
+         uint64_t get_scope()const { return _scope; }
+
+         const_iterator cbegin()const {
+            auto r = rows();
+            return const_iterator( this, r ? load_at( r->begin() ) : nullptr );
+         }
+         const_iterator begin()const { return cbegin(); }
+         const_iterator cend()const { return const_iterator( this ); }
+         const_iterator end()const { return cend(); }
+
+         const_iterator lower_bound( uint64_t primary )const {
+            auto r = rows();
+            return const_iterator( this, r ? load_at( r->lower_bound( primary ) ) : nullptr );
+         }
+
+         const_iterator upper_bound( uint64_t primary )const {
+            auto r = rows();
+            return const_iterator( this, r ? load_at( r->upper_bound( primary ) ) : nullptr );
+         }
+
+         uint64_t available_primary_key()const {
+            auto r = rows();
+            if( !r || r->empty() ) {
+               return 0;
+            }
+            return r->rbegin()->first + 1;
+         }
+
+         template<name::raw IndexName>
+         auto get_index()const {
+            constexpr uint64_t number = index_number<static_cast<uint64_t>(IndexName)>( std::index_sequence_for<Indices...>() );
+            static_assert( number < sizeof...(Indices), "name provided is not the name of any secondary index within multi_index" );
+            return index<static_cast<uint64_t>(IndexName), number>( this );
+         }
+
+         const_iterator iterator_to( const T& obj )const {
+            check_owned( obj, "object passed to iterator_to is not in multi_index" );
+            return const_iterator( this, &obj );
+         }
+
+         template<typename Lambda>
+         const_iterator emplace( name payer, Lambda&& constructor ) {
+            eosio_assert( _code.value == ::current_receiver(), "cannot create objects in table of another contract" );
+            eosio_assert( payer.value != 0, "must specify a valid account to pay for new record" );
+
+            auto obj = std::make_unique<T>();
+            constructor( *obj );
+            uint64_t pk = obj->primary_key();
+
+            auto& table = eosio_test::chain().tables[key()];
+            eosio_assert( table.find( pk ) == table.end(), "could not insert object, most likely a uniqueness constraint was violated" );
+
+            auto data = pack( *obj );
+            eosio_test::update_db_usage( payer.value, int64_t(data.size()) + eosio_test::row_overhead );
+            table[pk] = eosio_test::stored_row{ std::move(data), payer.value };
+            eosio_test::chain().db_writes++;
+
+            for_each_index( [&]( auto i ) {
+               uint64_t secondary = extract<decltype(i)::value>( *obj );
+               auto& s = eosio_test::chain().indexes[index_key( decltype(i)::value )];
+               eosio_test::update_db_usage( payer.value, eosio_test::index_overhead );
+               s.by_primary[pk] = secondary;
+               s.by_secondary.insert( { secondary, pk } );
+               s.payer[pk] = payer.value;
+               eosio_test::chain().db_writes++;
+            });
+
+            const T* item = ( _items[pk] = std::move(obj) ).get();
+            return const_iterator( this, item );
+         }
+
+         template<typename Lambda>
+         void modify( const_iterator itr, name payer, Lambda&& updater ) {
+            eosio_assert( itr != end(), "cannot pass end iterator to modify" );
+            modify( *itr, payer, std::forward<Lambda&&>(updater) );
+         }
+
+         template<typename Lambda>
+         void modify( const T& obj, name payer, Lambda&& updater ) {
+            eosio_assert( _code.value == ::current_receiver(), "cannot modify objects in table of another contract" );
+            check_owned( obj, "object passed to modify is not in multi_index" );
+
+            auto& mutableobj = const_cast<T&>( obj );
+            uint64_t pk = obj.primary_key();
+            uint64_t secondaries[sizeof...(Indices) + 1];
+            for_each_index( [&]( auto i ) {
+               secondaries[decltype(i)::value] = extract<decltype(i)::value>( obj );
+            });
+
+            updater( mutableobj );
+
+            eosio_assert( pk == obj.primary_key(), "updater cannot change primary key when modifying an object" );
+
+            auto& row = eosio_test::chain().tables[key()].at( pk );
+            auto data = pack( obj );
+            uint64_t new_payer = payer.value == 0 ? row.payer : payer.value;
+            int64_t old_size = row.data.size() + eosio_test::row_overhead;
+            int64_t new_size = data.size() + eosio_test::row_overhead;
+            if( new_payer != row.payer ) {
+               eosio_test::update_db_usage( row.payer, -old_size );
+               eosio_test::update_db_usage( new_payer, new_size );
+            } else if( old_size != new_size ) {
+               eosio_test::update_db_usage( row.payer, new_size - old_size );
+            }
+            row.data = std::move( data );
+            row.payer = new_payer;
+            eosio_test::chain().db_writes++;
+
+            for_each_index( [&]( auto i ) {
+               constexpr size_t number = decltype(i)::value;
+               uint64_t secondary = extract<number>( obj );
+               if( secondary == secondaries[number] ) {
+                  return;
+               }
+               auto& s = eosio_test::chain().indexes[index_key( number )];
+               auto e = s.by_primary.find( pk );
+               eosio_assert( e != s.by_primary.end(), "dereference of end iterator" );
+               uint64_t index_payer = payer.value == 0 ? s.payer[pk] : payer.value;
+               if( index_payer != s.payer[pk] ) {
+                  eosio_test::update_db_usage( s.payer[pk], -eosio_test::index_overhead );
+                  eosio_test::update_db_usage( index_payer, eosio_test::index_overhead );
+               }
+               s.by_secondary.erase( { e->second, pk } );
+               e->second = secondary;
+               s.by_secondary.insert( { secondary, pk } );
+               s.payer[pk] = index_payer;
+               eosio_test::chain().db_writes++;
+            });
+         }
+
+         const T& get( uint64_t primary, const char* error_msg = "unable to find key" )const {
+            auto result = find( primary );
+            eosio_assert( result != cend(), error_msg );
+            return *result;
+         }
+
+         const_iterator find( uint64_t primary )const {
+            return const_iterator( this, load( primary ) );
+         }
+
+         const_iterator require_find( uint64_t primary, const char* error_msg = "unable to find key" )const {
+            auto result = find( primary );
+            eosio_assert( result != cend(), error_msg );
+            return result;
+         }
+
+         const_iterator erase( const_iterator itr ) {
+            eosio_assert( itr != end(), "cannot pass end iterator to erase" );
+            const auto& obj = *itr;
+            ++itr;
+            erase( obj );
+            return itr;
+         }
+
+         void erase( const T& obj ) {
+            eosio_assert( _code.value == ::current_receiver(), "cannot erase objects in table of another contract" );
+            check_owned( obj, "object passed to erase is not in multi_index" );
+
+            uint64_t pk = obj.primary_key();
+            auto& table = eosio_test::chain().tables[key()];
+            auto row = table.find( pk );
+            eosio_assert( row != table.end(), "dereference of end iterator" );
+            eosio_test::update_db_usage( row->second.payer, -(int64_t(row->second.data.size()) + eosio_test::row_overhead) );
+            table.erase( row );
+            eosio_test::chain().db_writes++;
+
+            // a row stored before the index existed has no entry to remove
+            for_each_index( [&]( auto i ) {
+               auto& s = eosio_test::chain().indexes[index_key( decltype(i)::value )];
+               auto e = s.by_primary.find( pk );
+               if( e == s.by_primary.end() ) {
+                  return;
+               }
+               eosio_test::update_db_usage( s.payer[pk], -eosio_test::index_overhead );
+               s.by_secondary.erase( { e->second, pk } );
+               s.by_primary.erase( e );
+               s.payer.erase( pk );
+               eosio_test::chain().db_writes++;
+            });
+
+            _items.erase( pk );
+         }
+
+      private:
+         template<uint64_t IndexName, size_t... I>
+         static constexpr uint64_t index_number( std::index_sequence<I...> ) {
+            uint64_t number = sizeof...(Indices);
+            ((number = (uint64_t(index_at<I>::index_name) == IndexName && number == sizeof...(Indices)) ? I : number), ...);
+            return number;
+         }
+   };
+
+}
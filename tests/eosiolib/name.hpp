@@ -0,0 +1,87 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ */
+#pragma once
+
+#include "system.h"
+
+#include <string>
+#include <string_view>
+
+namespace eosio {
+
+   struct name {
+      enum class raw : uint64_t {};
+
+      constexpr name() : value(0) {}
+      constexpr explicit name( uint64_t v ) : value(v) {}
+      constexpr explicit name( name::raw r ) : value(static_cast<uint64_t>(r)) {}
+
+      constexpr explicit name( std::string_view str ) : value(0) {
+         if( str.size() > 13 ) {
+            eosio_assert( false, "string is too long to be a valid name" );
+         }
+         if( str.empty() ) {
+            return;
+         }
+         auto n = str.size() < 12 ? str.size() : 12;
+         for( decltype(n) i = 0; i < n; ++i ) {
+            value <<= 5;
+            value |= char_to_value( str[i] );
+         }
+         value <<= ( 4 + 5*(12 - n) );
+         if( str.size() == 13 ) {
+            uint64_t v = char_to_value( str[12] );
+            if( v > 0x0Full ) {
+               eosio_assert( false, "thirteenth character in name cannot be a letter that comes after j" );
+            }
+            value |= v;
+         }
+      }
+
+      static constexpr uint8_t char_to_value( char c ) {
+         if( c == '.' )
+            return 0;
+         else if( c >= '1' && c <= '5' )
+            return (c - '1') + 1;
+         else if( c >= 'a' && c <= 'z' )
+            return (c - 'a') + 6;
+         else
+            eosio_assert( false, "character is not in allowed character set for names" );
+         return 0;
+      }
+
+      constexpr operator raw()const { return raw(value); }
+      constexpr explicit operator bool()const { return value != 0; }
+
+      std::string to_string()const { return eosio_test::name_to_string( value ); }
+      void print()const { printn( value ); }
+
+      friend constexpr bool operator == ( const name& a, const name& b ) { return a.value == b.value; }
+      friend constexpr bool operator != ( const name& a, const name& b ) { return a.value != b.value; }
+      friend constexpr bool operator < ( const name& a, const name& b ) { return a.value < b.value; }
+
+      uint64_t value = 0;
+   };
+
+   namespace detail {
+      template <char... Str>
+      struct to_const_char_arr {
+         static constexpr const char value[] = {Str...};
+      };
+   }
+
+   inline namespace literals {
+      template <typename T, T... Str>
+      inline constexpr eosio::name operator""_n() {
+         constexpr auto x = eosio::name{std::string_view{eosio::detail::to_const_char_arr<Str...>::value, sizeof...(Str)}};
+         return x;
+      }
+   }
+
+   static constexpr name same_payer{};
+
+}
+
+using namespace eosio::literals;
@@ -0,0 +1,61 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ */
+#pragma once
+
+#include "name.hpp"
+
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace eosio {
+
+   inline void print( const char* ptr ) {
+      prints( ptr );
+   }
+
+   inline void print( const std::string& s ) {
+      prints_l( s.c_str(), s.size() );
+   }
+
+   inline void print( std::string_view s ) {
+      prints_l( s.data(), s.size() );
+   }
+
+   inline void print( char c ) {
+      prints_l( &c, 1 );
+   }
+
+   inline void print( bool val ) {
+      prints( val ? "true" : "false" );
+   }
+
+   template<typename T, std::enable_if_t<std::is_integral_v<T> && std::is_signed_v<T>, int> = 0>
+   inline void print( T num ) {
+      printi( num );
+   }
+
+   template<typename T, std::enable_if_t<std::is_integral_v<T> && !std::is_signed_v<T>, int> = 0>
+   inline void print( T num ) {
+      printui( num );
+   }
+
+   inline void print( name n ) {
+      printn( n.value );
+   }
+
+   // anything with a print() member, asset and symbol among them
+   template<typename T, std::enable_if_t<std::is_class_v<T>, int> = 0>
+   inline auto print( const T& t ) -> decltype( t.print(), void() ) {
+      t.print();
+   }
+
+   template<typename Arg, typename Arg2, typename... Args>
+   void print( Arg&& a, Arg2&& b, Args&&... args ) {
+      print( std::forward<Arg>(a) );
+      print( std::forward<Arg2>(b), std::forward<Args>(args)... );
+   }
+
+}
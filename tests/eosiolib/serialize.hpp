@@ -0,0 +1,24 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ */
+#pragma once
+
+#include <boost/preprocessor/seq/for_each.hpp>
+
+#define EOSLIB_REFLECT_MEMBER_OP( r, OP, elem ) \
+  OP t.elem
+
+/**
+ *  Defines the pack and unpack operators of TYPE over the listed members,
+ *  in the given order.
+ */
+#define EOSLIB_SERIALIZE( TYPE,  MEMBERS ) \
+ template<typename DataStream> \
+ friend DataStream& operator << ( DataStream& ds, const TYPE& t ){ \
+    return ds BOOST_PP_SEQ_FOR_EACH( EOSLIB_REFLECT_MEMBER_OP, <<, MEMBERS );\
+ }\
+ template<typename DataStream> \
+ friend DataStream& operator >> ( DataStream& ds, TYPE& t ){ \
+    return ds BOOST_PP_SEQ_FOR_EACH( EOSLIB_REFLECT_MEMBER_OP, >>, MEMBERS );\
+ }
@@ -0,0 +1,138 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ */
+#pragma once
+
+#include "datastream.hpp"
+#include "name.hpp"
+
+#include <string>
+#include <string_view>
+
+namespace eosio {
+
+   class symbol_code {
+      public:
+         constexpr symbol_code() : value(0) {}
+         constexpr explicit symbol_code( uint64_t raw ) : value(raw) {}
+
+         constexpr explicit symbol_code( std::string_view str ) : value(0) {
+            if( str.size() > 7 ) {
+               eosio_assert( false, "string is too long to be a valid symbol_code" );
+            }
+            for( auto itr = str.rbegin(); itr != str.rend(); ++itr ) {
+               if( *itr < 'A' || *itr > 'Z' ) {
+                  eosio_assert( false, "only uppercase letters allowed in symbol_code string" );
+               }
+               value <<= 8;
+               value |= *itr;
+            }
+         }
+
+         constexpr bool is_valid()const {
+            auto sym = value;
+            for( int i = 0; i < 7; i++ ) {
+               char c = (char)(sym & 0xFF);
+               if( !('A' <= c && c <= 'Z') ) return false;
+               sym >>= 8;
+               if( !(sym & 0xFF) ) {
+                  do {
+                     sym >>= 8;
+                     if( (sym & 0xFF) ) return false;
+                     i++;
+                  } while( i < 7 );
+               }
+            }
+            return true;
+         }
+
+         constexpr uint32_t length()const {
+            auto sym = value;
+            uint32_t len = 0;
+            while( sym & 0xFF && len <= 7 ) {
+               len++;
+               sym >>= 8;
+            }
+            return len;
+         }
+
+         constexpr uint64_t raw()const { return value; }
+         constexpr explicit operator bool()const { return value != 0; }
+
+         std::string to_string()const {
+            std::string s;
+            auto v = value;
+            for( auto i = 0; i < 7; ++i, v >>= 8 ) {
+               if( v == 0 ) break;
+               s += char(v & 0xFF);
+            }
+            return s;
+         }
+
+         void print()const { prints( to_string().c_str() ); }
+
+         friend constexpr bool operator == ( const symbol_code& a, const symbol_code& b ) { return a.value == b.value; }
+         friend constexpr bool operator != ( const symbol_code& a, const symbol_code& b ) { return a.value != b.value; }
+         friend constexpr bool operator < ( const symbol_code& a, const symbol_code& b ) { return a.value < b.value; }
+
+      private:
+         uint64_t value = 0;
+   };
+
+   class symbol {
+      public:
+         constexpr symbol() : value(0) {}
+         constexpr explicit symbol( uint64_t s ) : value(s) {}
+         constexpr symbol( symbol_code sc, uint8_t precision ) : value( (sc.raw() << 8) | (uint64_t)precision ) {}
+         constexpr symbol( std::string_view ss, uint8_t precision ) : value( (symbol_code(ss).raw() << 8) | (uint64_t)precision ) {}
+
+         constexpr bool is_valid()const { return code().is_valid(); }
+         constexpr uint8_t precision()const { return value & 0xFFull; }
+         constexpr symbol_code code()const { return symbol_code{value >> 8}; }
+         constexpr uint64_t raw()const { return value; }
+         constexpr explicit operator bool()const { return value != 0; }
+
+         void print( bool show_precision = true )const {
+            if( show_precision ) {
+               printui( precision() );
+               prints( "," );
+            }
+            code().print();
+         }
+
+         friend constexpr bool operator == ( const symbol& a, const symbol& b ) { return a.value == b.value; }
+         friend constexpr bool operator != ( const symbol& a, const symbol& b ) { return a.value != b.value; }
+         friend constexpr bool operator < ( const symbol& a, const symbol& b ) { return a.value < b.value; }
+
+      private:
+         uint64_t value = 0;
+   };
+
+   template<typename DS>
+   DS& operator << ( DS& ds, const symbol_code& sc ) {
+      return ds << sc.raw();
+   }
+
+   template<typename DS>
+   DS& operator >> ( DS& ds, symbol_code& sc ) {
+      uint64_t raw = 0;
+      ds >> raw;
+      sc = symbol_code( raw );
+      return ds;
+   }
+
+   template<typename DS>
+   DS& operator << ( DS& ds, const symbol& s ) {
+      return ds << s.raw();
+   }
+
+   template<typename DS>
+   DS& operator >> ( DS& ds, symbol& s ) {
+      uint64_t raw = 0;
+      ds >> raw;
+      s = symbol( raw );
+      return ds;
+   }
+
+}
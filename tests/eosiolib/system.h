@@ -0,0 +1,205 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ *
+ *  In-memory stand-in for the chain behind the eosiolib intrinsics, so the
+ *  contract can be compiled natively and driven from tests. One chain per
+ *  thread. Tables keep their rows packed exactly as nodeos would, RAM is
+ *  billed the way apply_context::update_db_usage bills it and a failed
+ *  eosio_assert throws eosio_test::assert_failure.
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace eosio_test {
+
+   struct assert_failure : std::runtime_error {
+      using std::runtime_error::runtime_error;
+   };
+
+   struct stored_row {
+      std::vector<char> data;
+      uint64_t          payer;
+   };
+
+   // one secondary index of one table/scope, the chain keeps it as a table
+   // of its own next to the primary rows
+   struct secondary_rows {
+      std::map<uint64_t, uint64_t>                  by_primary;
+      std::set<std::pair<uint64_t, uint64_t>>       by_secondary;
+      std::map<uint64_t, uint64_t>                  payer;
+   };
+
+   struct sent_action {
+      uint64_t                                      account;
+      uint64_t                                      name;
+      std::vector<std::pair<uint64_t, uint64_t>>    authorization;
+      std::vector<char>                             data;
+   };
+
+   // (code, scope, table)
+   typedef std::tuple<uint64_t, uint64_t, uint64_t> table_key;
+
+   // billable_size_v<key_value_object> and of a 64 bit index object
+   static constexpr int64_t row_overhead = 112;
+   static constexpr int64_t index_overhead = 112 + 8;
+
+   struct chain_state {
+      std::map<table_key, std::map<uint64_t, stored_row>>  tables;
+      std::map<table_key, secondary_rows>                   indexes;
+      std::map<uint64_t, int64_t>                           ram_usage;
+      std::set<uint64_t>                                    accounts;
+      uint32_t                                              now = 1546300800;
+
+      // row lookups that missed the multi_index cache, and rows stored,
+      // updated or removed (primary and secondary), since the chain began
+      uint64_t                                              db_reads = 0;
+      uint64_t                                              db_writes = 0;
+
+      // context of the action being applied
+      uint64_t                  receiver = 0;
+      std::set<uint64_t>        auths;
+      std::vector<char>         action_data;
+      std::vector<char>         transaction;
+      std::vector<uint64_t>     recipients;
+      std::vector<sent_action>  sent;
+      std::string               console;
+   };
+
+   inline chain_state& chain() {
+      static thread_local chain_state c;
+      return c;
+   }
+
+   inline std::string name_to_string( uint64_t value ) {
+      static const char* charmap = ".12345abcdefghijklmnopqrstuvwxyz";
+      std::string str( 13, '.' );
+      uint64_t tmp = value;
+      for( uint32_t i = 0; i <= 12; ++i ) {
+         char c = charmap[tmp & (i == 0 ? 0x0f : 0x1f)];
+         str[12 - i] = c;
+         tmp >>= (i == 0 ? 4 : 5);
+      }
+      str.erase( str.find_last_not_of( '.' ) + 1 );
+      return str;
+   }
+
+   // payer other than the receiver has to have signed for any growth
+   inline void update_db_usage( uint64_t payer, int64_t delta ) {
+      auto& c = chain();
+      if( delta > 0 && payer != c.receiver && c.auths.count( payer ) == 0 ) {
+         throw assert_failure( "missing authority of " + name_to_string( payer ) );
+      }
+      c.ram_usage[payer] += delta;
+   }
+
+}
+
+inline void eosio_assert( uint32_t test, const char* msg ) {
+   if( !test ) {
+      throw eosio_test::assert_failure( msg );
+   }
+}
+
+inline void eosio_assert_message( uint32_t test, const char* msg, uint32_t msg_len ) {
+   if( !test ) {
+      throw eosio_test::assert_failure( std::string( msg, msg_len ) );
+   }
+}
+
+inline uint32_t now() {
+   return eosio_test::chain().now;
+}
+
+inline uint64_t current_time() {
+   return uint64_t(eosio_test::chain().now) * 1000000;
+}
+
+inline uint64_t current_receiver() {
+   return eosio_test::chain().receiver;
+}
+
+inline void require_auth( uint64_t account ) {
+   if( eosio_test::chain().auths.count( account ) == 0 ) {
+      throw eosio_test::assert_failure( "missing authority of " + eosio_test::name_to_string( account ) );
+   }
+}
+
+inline bool has_auth( uint64_t account ) {
+   return eosio_test::chain().auths.count( account ) > 0;
+}
+
+inline bool is_account( uint64_t account ) {
+   return eosio_test::chain().accounts.count( account ) > 0;
+}
+
+inline void require_recipient( uint64_t account ) {
+   auto& r = eosio_test::chain().recipients;
+   for( auto a : r ) {
+      if( a == account ) {
+         return;
+      }
+   }
+   r.push_back( account );
+}
+
+inline uint32_t action_data_size() {
+   return eosio_test::chain().action_data.size();
+}
+
+inline uint32_t read_action_data( void* msg, uint32_t len ) {
+   const auto& d = eosio_test::chain().action_data;
+   uint32_t copied = len < d.size() ? len : d.size();
+   if( copied == 0 ) return 0;
+   memcpy( msg, d.data(), copied );
+   return copied;
+}
+
+inline size_t transaction_size() {
+   return eosio_test::chain().transaction.size();
+}
+
+inline int read_transaction( char* buffer, size_t size ) {
+   const auto& t = eosio_test::chain().transaction;
+   size_t copied = size < t.size() ? size : t.size();
+   memcpy( buffer, t.data(), copied );
+   return copied;
+}
+
+inline void prints( const char* cstr ) {
+   eosio_test::chain().console += cstr;
+}
+
+inline void prints_l( const char* cstr, uint32_t len ) {
+   eosio_test::chain().console.append( cstr, len );
+}
+
+inline void printi( int64_t value ) {
+   eosio_test::chain().console += std::to_string( value );
+}
+
+inline void printui( uint64_t value ) {
+   eosio_test::chain().console += std::to_string( value );
+}
+
+inline void printn( uint64_t name ) {
+   eosio_test::chain().console += eosio_test::name_to_string( name );
+}
+
+inline void printhex( const void* data, uint32_t datalen ) {
+   static const char* digits = "0123456789abcdef";
+   auto& out = eosio_test::chain().console;
+   auto bytes = static_cast<const unsigned char*>( data );
+   for( uint32_t i = 0; i < datalen; ++i ) {
+      out += digits[bytes[i] >> 4];
+      out += digits[bytes[i] & 0x0f];
+   }
+}
@@ -0,0 +1,30 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ */
+#pragma once
+
+#include <cstdint>
+
+namespace eosio {
+
+   // variable length unsigned 32 bit integer, packed as LEB128
+   struct unsigned_int {
+      unsigned_int( uint32_t v = 0 ) : value(v) {}
+
+      template<typename T>
+      unsigned_int( T v ) : value(v) {}
+
+      template<typename T>
+      operator T()const { return static_cast<T>(value); }
+
+      unsigned_int& operator=( uint32_t v ) { value = v; return *this; }
+
+      uint32_t value;
+
+      friend bool operator==( const unsigned_int& i, const uint32_t& v ) { return i.value == v; }
+      friend bool operator!=( const unsigned_int& i, const uint32_t& v ) { return i.value != v; }
+      friend bool operator<( const unsigned_int& a, const unsigned_int& b ) { return a.value < b.value; }
+   };
+
+}
@@ -0,0 +1,90 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ *
+ *  Runs brm-reconcile over the get_table_rows responses in
+ *  tests/fixtures/reconcile, hex rows packed with the contract's layouts.
+ *  Built like the tool, against the contract header and the stub eosiolib:
+ *
+ *     g++ -std=c++17 -pthread -Wno-attributes -I tests -I include -o reconcile_tests tests/reconcile_tests.cpp && ./reconcile_tests
+ */
+
+#include "../tools/brm-reconcile.hpp"
+#include "tester.hpp"
+
+namespace {
+
+   std::string fixture( const char* name ) {
+      std::string dir = __FILE__;
+      dir = dir.substr( 0, dir.rfind( '/' ) + 1 );
+      return dir + "fixtures/reconcile/" + name;
+   }
+
+   struct run_result {
+      int         status;
+      std::string csv;
+      std::string log;
+   };
+
+   std::string read_back( FILE* f ) {
+      std::string text;
+      char buf[256];
+      rewind( f );
+      while( fgets( buf, sizeof( buf ), f ) ) {
+         text += buf;
+      }
+      fclose( f );
+      return text;
+   }
+
+   run_result reconcile( const char* manifest, unsigned threads ) {
+      FILE* csv = tmpfile();
+      FILE* log = tmpfile();
+      int status = brm_reconcile::reconcile( fixture( manifest ).c_str(), threads, csv, log );
+      return run_result{ status, read_back( csv ), read_back( log ) };
+   }
+
+   const char* positions =
+      "owner,balance,staked,escrow,locked,payable,receivable\n"
+      "alice,9000,1000,50,0,0,200\n"
+      "bob,9500,0,0,500,200,0\n"
+      "carol,10000,0,0,0,0,0\n";
+
+}
+
+TEST( reconcile_matches_supply )
+{
+   auto r = reconcile( "manifest", 1 );
+   CHECK( r.status == 0 );
+   CHECK( r.csv == positions );
+}
+
+TEST( reconcile_threads_give_the_same_positions )
+{
+   auto r = reconcile( "manifest", 4 );
+   CHECK( r.status == 0 );
+   CHECK( r.csv == positions );
+}
+
+TEST( reconcile_reports_missing_balances )
+{
+   auto r = reconcile( "mismatch.manifest", 2 );
+   CHECK( r.status == 1 );
+}
+
+TEST( reconcile_flags_rows_with_bytes_left_over )
+{
+   auto r = reconcile( "trailing.manifest", 1 );
+   CHECK( r.status == 1 );
+   CHECK( r.log.find( "malformed 1" ) != std::string::npos );
+}
+
+TEST( reconcile_rejects_json_rows )
+{
+   CHECK( reconcile( "objects.manifest", 1 ).status == 2 );
+   CHECK( reconcile( "no-such.manifest", 1 ).status == 2 );
+}
+
+int main( int argc, char** argv ) {
+   return eosio_test::run_tests( argc, argv );
+}
@@ -0,0 +1,212 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ *
+ *  Drives the contract over the stub eosiolib in tests/eosiolib: actions
+ *  go through the contract's apply() with packed action data, one action
+ *  per transaction, and a failed eosio_assert rolls the tables back.
+ */
+#pragma once
+
+#include <eosiolib/asset.hpp>
+#include <eosiolib/eosio.hpp>
+
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <vector>
+
+extern "C" void apply( uint64_t receiver, uint64_t code, uint64_t action );
+
+namespace eosio_test {
+
+   struct check_failure : std::runtime_error {
+      using std::runtime_error::runtime_error;
+   };
+
+   struct test_case {
+      const char* name;
+      void (*run)();
+   };
+
+   inline std::vector<test_case>& registry() {
+      static std::vector<test_case> tests;
+      return tests;
+   }
+
+   struct registrar {
+      registrar( const char* name, void (*run)() ) { registry().push_back( { name, run } ); }
+   };
+
+#define TEST( NAME ) \
+   static void NAME(); \
+   static eosio_test::registrar NAME##_registrar( #NAME, &NAME ); \
+   static void NAME()
+
+#define CHECK( EXPR ) \
+   do { \
+      if( !(EXPR) ) { \
+         throw eosio_test::check_failure( std::string(__FILE__) + ":" + std::to_string(__LINE__) + ": CHECK(" #EXPR ") failed" ); \
+      } \
+   } while( 0 )
+
+// the statement has to fail an eosio_assert whose message contains MSG
+#define CHECK_ASSERT( MSG, ... ) \
+   do { \
+      std::string what_; \
+      bool thrown_ = false; \
+      try { __VA_ARGS__; } catch( const eosio_test::assert_failure& e ) { thrown_ = true; what_ = e.what(); } \
+      if( !thrown_ || what_.find( MSG ) == std::string::npos ) { \
+         throw eosio_test::check_failure( std::string(__FILE__) + ":" + std::to_string(__LINE__) + ": expected assertion \"" MSG "\", got " + \
+                                          (thrown_ ? "\"" + what_ + "\"" : std::string("none")) ); \
+      } \
+   } while( 0 )
+
+   // runs the registered tests whose name contains argv[1], if given
+   inline int run_tests( int argc, char** argv ) {
+      int failed = 0, run = 0;
+      for( const auto& t : registry() ) {
+         if( argc > 1 && !strstr( t.name, argv[1] ) ) {
+            continue;
+         }
+         run++;
+         try {
+            t.run();
+            printf( "ok   %s\n", t.name );
+         } catch( const std::exception& e ) {
+            failed++;
+            printf( "FAIL %s: %s\n", t.name, e.what() );
+         }
+      }
+      printf( "%d of %d tests failed\n", failed, run );
+      return failed > 0 ? 1 : 0;
+   }
+
+   template<typename T>
+   const T& packable( const T& v ) { return v; }
+   inline std::string packable( const char* s ) { return s; }
+
+   class tester {
+      public:
+         eosio::name contract;
+
+         // off for benchmarks on large tables, a failed action then leaves
+         // whatever it wrote behind
+         bool        rollback = true;
+
+         // transactions pushed so far
+         uint64_t    transactions = 0;
+
+         explicit tester( eosio::name c = eosio::name("brmtoken") ) : contract(c) {
+            chain() = chain_state{};
+            create_account( contract );
+         }
+
+         void create_account( eosio::name n ) { chain().accounts.insert( n.value ); }
+         void set_now( uint32_t t ) { chain().now = t; }
+         void advance( uint32_t seconds ) { chain().now += seconds; }
+         uint32_t now()const { return chain().now; }
+
+         /**
+          *  applies action with args packed in order, authorized by auths.
+          *  Arguments have to be of the action's parameter types.
+          */
+         template<typename... Args>
+         void push( eosio::name action, std::vector<eosio::name> auths, const Args&... args ) {
+            auto& c = chain();
+            decltype(c.tables) tables;
+            decltype(c.indexes) indexes;
+            decltype(c.ram_usage) ram;
+            if( rollback ) {
+               tables = c.tables;
+               indexes = c.indexes;
+               ram = c.ram_usage;
+            }
+
+            c.receiver = contract.value;
+            c.auths.clear();
+            for( auto a : auths ) {
+               c.auths.insert( a.value );
+            }
+            c.action_data = eosio::pack( std::make_tuple( packable( args )... ) );
+            // no two transactions pack the same, as expiration and TaPoS see to on chain
+            c.transaction = eosio::pack( std::make_tuple( ++transactions, action, c.action_data ) );
+            c.recipients.clear();
+            c.sent.clear();
+            c.console.clear();
+            try {
+               apply( contract.value, contract.value, action.value );
+            } catch( ... ) {
+               if( !rollback ) {
+                  throw;
+               }
+               c.tables = std::move( tables );
+               c.indexes = std::move( indexes );
+               c.ram_usage = std::move( ram );
+               throw;
+            }
+         }
+
+         const std::string& console()const { return chain().console; }
+         const std::vector<sent_action>& sent()const { return chain().sent; }
+         const std::vector<uint64_t>& recipients()const { return chain().recipients; }
+
+         // rows as another version of the contract (or nodeos) left them
+         template<typename T>
+         void put_row( eosio::name table, uint64_t scope, uint64_t pk, const T& row, eosio::name payer ) {
+            auto data = eosio::pack( row );
+            chain().ram_usage[payer.value] += data.size() + row_overhead;
+            chain().tables[table_key{ contract.value, scope, table.value }][pk] = stored_row{ std::move(data), payer.value };
+         }
+
+         void erase_row( eosio::name table, uint64_t scope, uint64_t pk ) {
+            auto& rows = chain().tables[table_key{ contract.value, scope, table.value }];
+            auto r = rows.find( pk );
+            if( r != rows.end() ) {
+               chain().ram_usage[r->second.payer] -= r->second.data.size() + row_overhead;
+               rows.erase( r );
+            }
+         }
+
+         void put_index( eosio::name table, uint64_t number, uint64_t scope, uint64_t pk, uint64_t secondary, eosio::name payer ) {
+            auto& s = chain().indexes[table_key{ contract.value, scope, (table.value & 0xFFFFFFFFFFFFFFF0ULL) | number }];
+            s.by_primary[pk] = secondary;
+            s.by_secondary.insert( { secondary, pk } );
+            s.payer[pk] = payer.value;
+         }
+
+         const stored_row* find_row( eosio::name table, uint64_t scope, uint64_t pk )const {
+            auto& tables = chain().tables;
+            auto t = tables.find( table_key{ contract.value, scope, table.value } );
+            if( t == tables.end() ) {
+               return nullptr;
+            }
+            auto r = t->second.find( pk );
+            return r == t->second.end() ? nullptr : &r->second;
+         }
+
+         template<typename T>
+         std::optional<T> get_row( eosio::name table, uint64_t scope, uint64_t pk )const {
+            auto r = find_row( table, scope, pk );
+            if( !r ) {
+               return std::nullopt;
+            }
+            return eosio::unpack<T>( r->data );
+         }
+
+         size_t row_count( eosio::name table, uint64_t scope )const {
+            auto& tables = chain().tables;
+            auto t = tables.find( table_key{ contract.value, scope, table.value } );
+            return t == tables.end() ? 0 : t->second.size();
+         }
+
+         // number of entries of the table's secondary index number
+         size_t index_count( eosio::name table, uint64_t number, uint64_t scope )const {
+            auto& indexes = chain().indexes;
+            auto s = indexes.find( table_key{ contract.value, scope, (table.value & 0xFFFFFFFFFFFFFFF0ULL) | number } );
+            return s == indexes.end() ? 0 : s->second.by_primary.size();
+         }
+   };
+
+}
@@ -0,0 +1,160 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ *
+ *  Per action cost of the hot paths as the tables grow, against the stub
+ *  eosiolib in tests/eosiolib:
+ *
+ *     g++ -std=c++17 -O2 -Wno-attributes -I tests -I include -o token_bench tests/token_bench.cpp && ./token_bench [max_rows]
+ *
+ *  The -DBRM_* flags of the contract apply, actions left out of the build
+ *  are skipped.
+ *
+ *  For every table size up to max_rows (default 100000, 1000000 needs a
+ *  few GB) the tables are filled through the contract's own actions and
+ *  each action is then run repeatedly. Per call it reports the time spent
+ *  in apply(), rows looked up outside the multi_index cache, rows written
+ *  (primary and secondary) and RAM billed. The native ns/op only compare
+ *  revisions and actions with each other, they are not the wasm cost.
+ */
+
+#include "../src/eosio.token.cpp"
+#include "tester.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+
+using namespace eosio;
+using eosio_test::tester;
+
+namespace {
+
+   const symbol BRM = symbol("BRM", 3);
+
+   const name self = name("brmtoken");
+   const name issuer = name("issuer");
+   const name alice = name("alice");
+   const name bob = name("bob");
+
+   const uint32_t RUNS = 2000;
+
+   asset brm( int64_t amount ) { return asset( amount, BRM ); }
+
+   struct bench_tester : tester {
+      bench_tester() {
+         rollback = false;
+         for( auto n : { issuer, alice, bob } ) {
+            create_account( n );
+         }
+#ifndef BRM_NO_STAKING
+         push( "splitconfig"_n, { self } );
+#endif
+         push( "create"_n, { self }, issuer, brm( asset::max_amount ) );
+         push( "issue"_n, { issuer }, alice, brm( 1000000000000 ), "" );
+         push( "issue"_n, { issuer }, bob, brm( 1000000000000 ), "" );
+      }
+
+      // other owners, so the registry and the per owner scopes fill up
+      static name holder( uint32_t i ) {
+         return name( (uint64_t(i) + 1) << 20 );
+      }
+
+      void add_holders( uint32_t n ) {
+         for( uint32_t i = 0; i < n; ++i ) {
+            create_account( holder( i ) );
+            push( "issue"_n, { issuer }, holder( i ), brm( 1000 ), "" );
+         }
+      }
+   };
+
+   struct result {
+      double   ns;
+      double   reads;
+      double   writes;
+      double   ram;
+   };
+
+   // times run(i) for i in [0, RUNS), setup(i) before each call is not counted
+   result measure( const std::function<void(uint32_t)>& run, const std::function<void(uint32_t)>& setup = {} ) {
+      auto& c = eosio_test::chain();
+      uint64_t reads = 0, writes = 0;
+      int64_t ram = 0;
+      std::chrono::nanoseconds elapsed( 0 );
+      for( uint32_t i = 0; i < RUNS; ++i ) {
+         if( setup ) {
+            setup( i );
+         }
+         uint64_t r0 = c.db_reads, w0 = c.db_writes;
+         int64_t ram0 = 0;
+         for( const auto& u : c.ram_usage ) {
+            ram0 += u.second;
+         }
+         auto start = std::chrono::steady_clock::now();
+         run( i );
+         elapsed += std::chrono::steady_clock::now() - start;
+         reads += c.db_reads - r0;
+         writes += c.db_writes - w0;
+         for( const auto& u : c.ram_usage ) {
+            ram += u.second;
+         }
+         ram -= ram0;
+      }
+      return result{ double(elapsed.count()) / RUNS, double(reads) / RUNS, double(writes) / RUNS, double(ram) / RUNS };
+   }
+
+   void report( const char* action, uint32_t rows, const result& r ) {
+      printf( "%-12s %9u %10.0f %8.1f %8.1f %10.1f\n", action, rows, r.ns, r.reads, r.writes, r.ram );
+      fflush( stdout );
+   }
+
+}
+
+int main( int argc, char** argv )
+{
+   uint32_t max_rows = argc > 1 ? strtoul( argv[1], nullptr, 10 ) : 100000;
+
+   printf( "%-12s %9s %10s %8s %8s %10s\n", "action", "rows", "ns/op", "reads", "writes", "ram bytes" );
+   for( uint32_t rows = 1; rows <= max_rows; rows *= 10 ) {
+      {
+         bench_tester t;
+         t.add_holders( rows );
+         report( "transfer", rows, measure( [&]( uint32_t ) {
+            t.push( "transfer"_n, { alice }, alice, bob, brm( 1 ), "bench" );
+         }));
+      }
+#ifndef BRM_NO_STAKING
+      {
+         bench_tester t;
+         t.add_holders( rows );
+         for( uint32_t i = 0; i < rows; ++i ) {
+            t.push( "stake"_n, { bench_tester::holder( i ) }, bench_tester::holder( i ), brm( 100 ) );
+         }
+         t.push( "stake"_n, { alice }, alice, brm( 1000000 ) );
+         report( "stake", rows, measure( [&]( uint32_t ) {
+            t.push( "stake"_n, { alice }, alice, brm( 1 ) );
+         }));
+         report( "unstake", rows, measure( [&]( uint32_t ) {
+            t.push( "unstake"_n, { alice }, alice, brm( 1 ) );
+         }));
+      }
+#endif
+#ifndef BRM_NO_INVOICES
+      {
+         bench_tester t;
+         for( uint32_t i = 0; i < rows; ++i ) {
+            t.push( "sendinvoice"_n, { alice }, alice, bob, brm( 10 ), t.now(), "monthly fee" );
+         }
+         report( "sendinvoice", rows, measure( [&]( uint32_t ) {
+            t.push( "sendinvoice"_n, { alice }, alice, bob, brm( 10 ), t.now(), "monthly fee" );
+         }));
+         // the invoices sent by the sendinvoice run, ids counting up from 2^32
+         uint64_t first = (1ull << 32) + rows;
+         report( "payinvoice", rows, measure( [&]( uint32_t i ) {
+            t.push( "payinvoice"_n, { bob }, bob, first + i, brm( 10 ) );
+         }));
+      }
+#endif
+   }
+   return 0;
+}
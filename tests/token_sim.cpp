@@ -0,0 +1,484 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ *
+ *  Randomized simulation of the contract against the stub eosiolib in
+ *  tests/eosiolib:
+ *
+ *     g++ -std=c++17 -O2 -pthread -Wno-attributes -I tests -I include -o token_sim tests/token_sim.cpp
+ *     ./token_sim [steps] [seeds] [first_seed] [threads]
+ *
+ *  Every seed (default 64 of them, from first_seed 1) runs steps (default
+ *  10000) random issue, transfer, stake, unstake, refund, distribute,
+ *  claimreward, sendinvoice, payinvoice, rejectinvoice, purgeinvs,
+ *  setallowance and collectinvs actions between a handful of accounts,
+ *  with the clock moved forward at random. Actions the contract refuses
+ *  are rolled back and counted. After every step the tables are checked:
+ *
+ *   - supply equals balances plus staked plus locked plus unclaimed rewards
+ *   - stakestate counters match the stakebals rows
+ *   - open invoices and cinvoices rows match one to one
+ *   - each descrs row is referenced by exactly refs invoices and
+ *     templates, and every referenced key has its row
+ *
+ *  A seed replays the same run wherever it runs. Seeds are spread over
+ *  threads (default one per core), each with a chain of its own. A failing
+ *  seed prints its step and action and the exit status is 1. So is a run
+ *  in which any of the invoice actions got applied less than MIN_SHARE of
+ *  the time, which is what a generator that only produces refused actions
+ *  looks like.
+ */
+
+#include "../src/eosio.token.cpp"
+#include "tester.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+
+using namespace eosio;
+using eosio_test::tester;
+
+namespace {
+
+   const symbol BRM = symbol("BRM", 3);
+
+   const name self = name("brmtoken");
+   const name issuer = name("issuer");
+   const std::vector<name> users = { name("alice"), name("bob"), name("carol"), name("dave"), name("erin"), name("frank") };
+
+   asset brm( int64_t amount ) { return asset( amount, BRM ); }
+
+   // rows as the checks read them back, packed like the contract's
+   struct account_row {
+      asset       balance;
+   };
+
+   struct currency_stats_row {
+      asset       supply;
+      asset       max_supply;
+      name        issuer;
+   };
+
+#ifndef BRM_NO_STAKING
+   struct stake_state_row {
+      uint32_t    active_accounts;
+      int64_t     staked_weekly;
+      int64_t     staked_monthly;
+      int64_t     staked_quarterly;
+      int64_t     total_staked;
+      uint64_t    total_shares;
+      uint64_t    reward_per_share;
+      int64_t     total_payout;
+      int64_t     unclaimed_tokens;
+   };
+
+   struct stake_row {
+      int64_t     staked;
+      int64_t     escrow;
+      uint64_t    reward_checkpoint;
+      uint32_t    stake_date;
+      uint32_t    stake_due;
+      uint8_t     stake_period;
+   };
+
+   struct lock_tranche_row {
+      int64_t     amount;
+      uint32_t    due;
+   };
+
+   struct lock_row {
+      std::vector<lock_tranche_row> tranches;
+   };
+
+   // period multipliers x100, as stake_shares
+   uint64_t shares( uint8_t period, int64_t amount ) {
+      uint64_t multiplier = period == 2 ? 150 : period == 3 ? 200 : 100;
+      return static_cast<uint64_t>( uint128_t(amount) * multiplier / 100 );
+   }
+#endif
+
+#ifndef BRM_NO_INVOICES
+   struct invoice_row {
+      uint64_t    invoice_id_key;
+      uint8_t     invoice_status;
+      name        from_account;
+      name        to_account;
+      asset       invoice_total;
+      asset       paid_total;
+      uint32_t    payment_due;
+      uint32_t    payment_date;
+      uint64_t    payment_id;
+      uint64_t    descr_key;
+   };
+
+   struct recurring_row {
+      uint64_t    template_id;
+      name        to_account;
+      asset       amount;
+      uint32_t    period;
+      uint32_t    next_due;
+      uint64_t    payment_id;
+      uint64_t    descr_key;
+   };
+
+   struct customer_invoice_row {
+      uint64_t    invoice_id_key;
+      uint32_t    created_date;
+      name        sender;
+   };
+
+   struct descr_row {
+      uint64_t    descr_key;
+      uint32_t    refs;
+      std::string text;
+   };
+
+   const uint64_t FIRST_INVOICE_ID = 1ull << 32;
+   const uint8_t  STATUS_OPEN = 1;
+
+   // few enough texts that invoices share them
+   const std::vector<std::string> descriptions = { "", "rent", "power", "hosting" };
+
+   // each of these has to be applied in at least this share of all actions
+   const std::vector<std::string> required = { "sendinvoice", "payinvoice", "rejectinvoice", "purgeinvs", "collectinvs" };
+   const double MIN_SHARE = 0.01;
+#endif
+
+   struct invariant_failure : std::runtime_error {
+      using std::runtime_error::runtime_error;
+   };
+
+#define INVARIANT( EXPR ) \
+   do { \
+      if( !(EXPR) ) { \
+         throw invariant_failure( "invariant " #EXPR " does not hold" ); \
+      } \
+   } while( 0 )
+
+   struct stats {
+      std::map<std::string, uint64_t> applied;      // by action
+      uint64_t refused = 0;
+   };
+
+   class simulation : public tester {
+      public:
+         explicit simulation( uint64_t seed ) : rng( seed ) {
+            create_account( issuer );
+            for( auto u : users ) {
+               create_account( u );
+            }
+#ifndef BRM_NO_STAKING
+            push( "splitconfig"_n, { self } );
+#endif
+            push( "create"_n, { self }, issuer, brm( 1000000000000 ) );
+         }
+
+         // one random action, described in what for failure reports
+         void step( stats& st, std::string& what ) {
+            advance( pick( 4 ) == 0 ? pick( 3 * 24 * 3600 ) : pick( 60 ) );
+
+            try {
+               act( what );
+               st.applied[what.substr( 0, what.find( ' ' ) )]++;
+            } catch( const eosio_test::assert_failure& e ) {
+               st.refused++;
+               what += std::string( " refused: " ) + e.what();
+            }
+            check();
+         }
+
+      private:
+         std::mt19937_64  rng;
+#ifndef BRM_NO_INVOICES
+         // every invoice sent, with its merchant
+         std::vector<std::pair<uint64_t, name>> invoices;
+#endif
+
+         uint64_t pick( uint64_t n ) { return std::uniform_int_distribution<uint64_t>( 0, n - 1 )( rng ); }
+         name user() { return users[pick( users.size() )]; }
+
+         // mostly small amounts, now and then more than anyone has
+         int64_t amount() {
+            switch( pick( 8 ) ) {
+               case 0:  return 1 + pick( 100000000 );
+               case 1:  return int64_t( pick( 3 ) );
+               default: return 1 + pick( 10000 );
+            }
+         }
+
+         // desc starts with the action name and is filled in before the
+         // action is pushed
+         void act( std::string& desc ) {
+            name a = user(), b = user();
+            int64_t q = amount();
+            auto name_of = []( name n ) { return n.to_string(); };
+            switch( pick( 16 ) ) {
+               case 0:
+                  desc = "issue " + name_of( a ) + " " + std::to_string( q );
+                  push( "issue"_n, { issuer }, a, brm( q ), "" );
+                  break;
+               case 1:
+               case 2:
+                  desc = "transfer " + name_of( a ) + " " + name_of( b ) + " " + std::to_string( q );
+                  push( "transfer"_n, { a }, a, b, brm( q ), "" );
+                  break;
+#ifndef BRM_NO_STAKING
+               case 3:
+                  desc = "stake " + name_of( a ) + " " + std::to_string( q );
+                  push( "stake"_n, { a }, a, brm( q ) );
+                  break;
+               case 4:
+                  desc = "unstake " + name_of( a ) + " " + std::to_string( q );
+                  push( "unstake"_n, { a }, a, brm( q ) );
+                  break;
+               case 5:
+                  if( pick( 2 ) ) {
+                     desc = "refund " + name_of( a );
+                     push( "refund"_n, { a }, a );
+                  } else {
+                     desc = "claimreward " + name_of( a );
+                     push( "claimreward"_n, { a }, a );
+                  }
+                  break;
+               case 6:
+                  // rewards come out of the contract's own balance
+                  desc = "distribute " + std::to_string( q );
+                  push( "issue"_n, { issuer }, self, brm( q ), "" );
+                  push( "distribute"_n, { self }, brm( q ) );
+                  break;
+#endif
+#ifndef BRM_NO_INVOICES
+               case 7:
+               case 8: {
+                  // sendinvoice only takes due dates that have passed
+                  uint32_t due = now() - pick( 3600 );
+                  const auto& descr = descriptions[pick( descriptions.size() )];
+                  desc = "sendinvoice " + name_of( a ) + " " + name_of( b ) + " " + std::to_string( q ) + " " + std::to_string( due ) + " \"" + descr + "\"";
+                  push( "sendinvoice"_n, { a }, a, b, brm( q ), due, descr );
+                  invoices.emplace_back( FIRST_INVOICE_ID + invoices.size(), a );
+                  break;
+               }
+               case 9:
+               case 10:
+               case 11: {
+                  // before the first invoice this one is refused as unknown
+                  auto [id, merchant] = invoices.empty() ? std::make_pair( FIRST_INVOICE_ID, a ) : invoices[pick( invoices.size() )];
+                  auto inv = get_row<invoice_row>( "minvoices"_n, merchant.value, id );
+                  // the customer most of the time, anyone now and then
+                  name payer = inv && pick( 4 ) ? inv->to_account : a;
+                  asset total = inv && pick( 4 ) ? inv->invoice_total : brm( q );
+                  if( pick( 3 ) ) {
+                     desc = "payinvoice " + name_of( payer ) + " " + std::to_string( id ) + " " + std::to_string( total.amount );
+                     push( "payinvoice"_n, { payer }, payer, id, total );
+                  } else {
+                     desc = "rejectinvoice " + name_of( payer ) + " " + std::to_string( id );
+                     push( "rejectinvoice"_n, { payer }, payer, id, "sim" );
+                  }
+                  break;
+               }
+               case 12: {
+                  uint32_t cutoff = now() + 1 - pick( 3600 );
+                  uint32_t max_rows = 1 + pick( 4 );
+                  desc = "purgeinvs " + name_of( a ) + " " + std::to_string( cutoff ) + " " + std::to_string( max_rows );
+                  push( "purgeinvs"_n, { a }, a, cutoff, max_rows );
+                  break;
+               }
+               case 13: {
+                  uint32_t period = uint32_t( pick( 3 ) ) * 3600;
+                  desc = "setallowance " + name_of( a ) + " " + name_of( b ) + " " + std::to_string( q ) + " " + std::to_string( period );
+                  push( "setallowance"_n, { a }, a, b, brm( q ), period );
+                  break;
+               }
+               case 14: {
+                  uint32_t max_rows = 1 + pick( 8 );
+                  desc = "collectinvs " + name_of( a ) + " " + std::to_string( max_rows );
+                  push( "collectinvs"_n, { a }, a, uint32_t(0), max_rows );
+                  break;
+               }
+#endif
+               default:
+                  desc = "transfer " + name_of( a ) + " " + name_of( b ) + " " + std::to_string( q );
+                  push( "transfer"_n, { a }, a, b, brm( q ), "" );
+                  break;
+            }
+         }
+
+         template<typename T, typename F>
+         void for_each_row( name table, F&& f )const {
+            for( const auto& [key, rows] : eosio_test::chain().tables ) {
+               if( std::get<0>( key ) != contract.value || std::get<2>( key ) != table.value ) {
+                  continue;
+               }
+               for( const auto& [pk, row] : rows ) {
+                  f( std::get<1>( key ), pk, eosio::unpack<T>( row.data ) );
+               }
+            }
+         }
+
+         void check()const {
+            auto stat = get_row<currency_stats_row>( "stat"_n, BRM.code().raw(), BRM.code().raw() );
+            INVARIANT( stat.has_value() );
+
+            int64_t balances = 0;
+            for_each_row<account_row>( "accounts"_n, [&]( uint64_t, uint64_t, const account_row& r ) {
+               INVARIANT( r.balance.amount >= 0 );
+               balances += r.balance.amount;
+            });
+            int64_t accounted = balances;
+
+#ifndef BRM_NO_STAKING
+            int64_t staked[4] = {};
+            int64_t escrow = 0;
+            uint64_t total_shares = 0;
+            uint32_t active = 0;
+            for_each_row<stake_row>( "stakebals"_n, [&]( uint64_t, uint64_t pk, const stake_row& r ) {
+               INVARIANT( pk == BRM.code().raw() );
+               INVARIANT( r.staked > 0 && r.stake_period >= 1 && r.stake_period <= 3 );
+               staked[r.stake_period] += r.staked;
+               escrow += r.escrow;
+               total_shares += shares( r.stake_period, r.staked );
+               active++;
+            });
+            int64_t locked = 0;
+            for_each_row<lock_row>( "locks"_n, [&]( uint64_t, uint64_t, const lock_row& r ) {
+               INVARIANT( !r.tranches.empty() );
+               for( const auto& t : r.tranches ) {
+                  INVARIANT( t.amount > 0 );
+                  locked += t.amount;
+               }
+            });
+
+            auto ss = get_row<stake_state_row>( "stakestate"_n, self.value, "stakestate"_n.value ).value_or( stake_state_row{} );
+            INVARIANT( ss.staked_weekly == staked[1] );
+            INVARIANT( ss.staked_monthly == staked[2] );
+            INVARIANT( ss.staked_quarterly == staked[3] );
+            INVARIANT( ss.total_staked == staked[1] + staked[2] + staked[3] );
+            INVARIANT( ss.total_shares == total_shares );
+            INVARIANT( ss.active_accounts == active );
+            // settled rewards are part of the unclaimed ones
+            INVARIANT( escrow <= ss.unclaimed_tokens );
+            accounted += ss.total_staked + locked + ss.unclaimed_tokens;
+#endif
+            INVARIANT( stat->supply.amount == accounted );
+
+#ifndef BRM_NO_INVOICES
+            // purged invoices are gone from both sides
+            size_t open = 0;
+            std::map<uint64_t, uint32_t> refs;
+            for_each_row<invoice_row>( "minvoices"_n, [&]( uint64_t merchant, uint64_t pk, const invoice_row& r ) {
+               INVARIANT( r.invoice_id_key == pk && r.from_account.value == merchant );
+               auto cinv = get_row<customer_invoice_row>( "cinvoices"_n, r.to_account.value, pk );
+               INVARIANT( cinv.has_value() == (r.invoice_status == STATUS_OPEN) );
+               if( cinv ) {
+                  INVARIANT( cinv->sender.value == merchant );
+                  open++;
+               }
+               if( r.descr_key ) {
+                  refs[r.descr_key]++;
+               }
+            });
+            for_each_row<recurring_row>( "rtemplates"_n, [&]( uint64_t, uint64_t, const recurring_row& r ) {
+               if( r.descr_key ) {
+                  refs[r.descr_key]++;
+               }
+            });
+            size_t customer_rows = 0;
+            for_each_row<customer_invoice_row>( "cinvoices"_n, [&]( uint64_t, uint64_t, const customer_invoice_row& ) {
+               customer_rows++;
+            });
+            INVARIANT( customer_rows == open );
+
+            size_t descr_rows = 0;
+            for_each_row<descr_row>( "descrs"_n, [&]( uint64_t, uint64_t pk, const descr_row& d ) {
+               INVARIANT( d.descr_key == pk && d.refs > 0 && !d.text.empty() );
+               auto r = refs.find( pk );
+               INVARIANT( r != refs.end() && r->second == d.refs );
+               descr_rows++;
+            });
+            INVARIANT( descr_rows == refs.size() );
+#endif
+         }
+   };
+
+   std::mutex report_mutex;
+
+   // runs seed to the end, false with a report on the first broken invariant
+   bool run_seed( uint64_t seed, uint32_t steps, stats& st ) {
+      simulation sim( seed );
+      for( uint32_t i = 0; i < steps; ++i ) {
+         std::string what;
+         try {
+            sim.step( st, what );
+         } catch( const std::exception& e ) {
+            std::lock_guard<std::mutex> lock( report_mutex );
+            printf( "FAIL seed %llu step %u \"%s\": %s\n", (unsigned long long)seed, i, what.c_str(), e.what() );
+            return false;
+         }
+      }
+      return true;
+   }
+
+}
+
+int main( int argc, char** argv )
+{
+   uint32_t steps = argc > 1 ? strtoul( argv[1], nullptr, 10 ) : 10000;
+   uint64_t seeds = argc > 2 ? strtoull( argv[2], nullptr, 10 ) : 64;
+   uint64_t first_seed = argc > 3 ? strtoull( argv[3], nullptr, 10 ) : 1;
+   unsigned threads = argc > 4 ? strtoul( argv[4], nullptr, 10 ) : std::thread::hardware_concurrency();
+   threads = std::max( 1u, std::min<unsigned>( threads, seeds ) );
+
+   std::atomic<uint64_t> next( 0 );
+   std::atomic<uint64_t> failed( 0 );
+   std::vector<stats> per_thread( threads );
+   std::vector<std::thread> workers;
+   auto start = std::chrono::steady_clock::now();
+   for( unsigned t = 0; t < threads; ++t ) {
+      workers.emplace_back( [&, t]() {
+         for( uint64_t i = next++; i < seeds; i = next++ ) {
+            if( !run_seed( first_seed + i, steps, per_thread[t] ) ) {
+               failed++;
+            }
+         }
+      });
+   }
+   for( auto& w : workers ) {
+      w.join();
+   }
+   double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+   stats total;
+   uint64_t applied = 0;
+   for( const auto& st : per_thread ) {
+      for( const auto& [action, n] : st.applied ) {
+         total.applied[action] += n;
+         applied += n;
+      }
+      total.refused += st.refused;
+   }
+   uint64_t actions = applied + total.refused;
+   printf( "%llu seeds, %llu actions (%llu refused) on %u threads in %.1f s, %.0f actions/s, %llu seeds failed\n",
+           (unsigned long long)seeds, (unsigned long long)actions, (unsigned long long)total.refused, threads,
+           seconds, seconds > 0 ? actions / seconds : 0.0, (unsigned long long)failed.load() );
+   printf( "applied:" );
+   for( const auto& [action, n] : total.applied ) {
+      printf( " %s %llu", action.c_str(), (unsigned long long)n );
+   }
+   printf( "\n" );
+
+   bool starved = false;
+#ifndef BRM_NO_INVOICES
+   for( const auto& action : required ) {
+      if( total.applied[action] < actions * MIN_SHARE ) {
+         printf( "FAIL %s applied %llu times, less than %.0f%% of all actions\n",
+                 action.c_str(), (unsigned long long)total.applied[action], MIN_SHARE * 100 );
+         starved = true;
+      }
+   }
+#endif
+   return failed > 0 || starved ? 1 : 0;
+}
@@ -0,0 +1,1081 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ *
+ *  Native tests of the contract against the stub eosiolib in tests/eosiolib,
+ *  no node or eosio-cpp needed:
+ *
+ *     g++ -std=c++17 -Wno-attributes -I tests -I include -o token_tests tests/token_tests.cpp && ./token_tests
+ *
+ *  The same -DBRM_* flags as for the contract select the variant under
+ *  test; an argument runs only the tests whose name contains it.
+ */
+
+#include "../src/eosio.token.cpp"
+#include "tester.hpp"
+
+using namespace eosio;
+using eosio_test::tester;
+
+namespace {
+
+   const symbol BRM = symbol("BRM", 3);
+
+   const name self = name("brmtoken");
+   const name issuer = name("issuer");
+   const name alice = name("alice");
+   const name bob = name("bob");
+   const name carol = name("carol");
+
+   asset brm( int64_t amount ) { return asset( amount, BRM ); }
+
+   // rows as the tests read them back, packed like the contract's
+   struct account_row {
+      asset       balance;
+   };
+
+   struct currency_stats_row {
+      asset       supply;
+      asset       max_supply;
+      name        issuer;
+   };
+
+   // the configs row as deployed, before splitconfig
+   struct legacy_config_row {
+      uint64_t    config_id;
+      uint8_t     running;
+      name        overflow;
+      uint32_t    active_accounts;
+      asset       staked_weekly;
+      asset       staked_monthly;
+      asset       staked_quarterly;
+      asset       total_staked;
+      asset       total_escrowed_monthly;
+      asset       total_escrowed_quarterly;
+      uint64_t    total_shares;
+      asset       base_payout;
+      asset       bonus;
+      asset       total_payout;
+      asset       interest_share;
+      asset       unclaimed_tokens;
+      asset       spare_a1;
+      asset       spare_a2;
+      uint64_t    spare_i1;
+      uint64_t    spare_i2;
+   };
+
+   // amounts in raw BRM units
+   struct stake_state_row {
+      uint32_t    active_accounts;
+      int64_t     staked_weekly;
+      int64_t     staked_monthly;
+      int64_t     staked_quarterly;
+      int64_t     total_staked;
+      uint64_t    total_shares;
+      uint64_t    reward_per_share;
+      int64_t     total_payout;
+      int64_t     unclaimed_tokens;
+   };
+
+   // amounts in raw BRM units
+   struct stake_row {
+      int64_t     staked;
+      int64_t     escrow;
+      uint64_t    reward_checkpoint;
+      uint32_t    stake_date;
+      uint32_t    stake_due;
+      uint8_t     stake_period;
+   };
+
+   struct lock_tranche_row {
+      int64_t     amount;
+      uint32_t    due;
+   };
+
+   struct lock_row {
+      std::vector<lock_tranche_row> tranches;
+   };
+
+   // stakes and lockedbals rows as the deployed contract writes them
+   struct legacy_stake_row {
+      name        stake_account;
+      uint8_t     stake_period;
+      asset       staked;
+      uint32_t    stake_date;
+      uint32_t    stake_due;
+      asset       escrow;
+   };
+
+   struct legacy_lock_row {
+      name        stake_account;
+      asset       locked_balance;
+      uint32_t    refund_due;
+   };
+
+   const uint32_t TENDAY_WAIT = 60 * 60 * 24 * 10;
+
+   struct invoice_row {
+      uint64_t    invoice_id_key;
+      uint8_t     invoice_status;
+      name        from_account;
+      name        to_account;
+      asset       invoice_total;
+      asset       paid_total;
+      uint32_t    payment_due;
+      uint32_t    payment_date;
+      uint64_t    payment_id;
+      uint64_t    descr_key;
+   };
+
+   // uinvoices row as the deployed contract writes it
+   struct legacy_invoice_row {
+      uint64_t    invoice_id_key;
+      uint8_t     invoice_status;
+      name        from_account;
+      name        to_account;
+      asset       invoice_total;
+      asset       paid_total;
+      uint32_t    payment_due;
+      uint32_t    payment_date;
+      std::string payment_id;
+      std::string invoice_descr;
+   };
+
+   struct descr_row {
+      uint64_t    descr_key;
+      uint32_t    refs;
+      std::string text;
+   };
+
+   struct allowance_row {
+      name        merchant;
+      asset       cap;
+      asset       spent;
+      uint32_t    period;
+      uint32_t    period_start;
+   };
+
+   struct recurring_row {
+      uint64_t    template_id;
+      name        to_account;
+      asset       amount;
+      uint32_t    period;
+      uint32_t    next_due;
+      uint64_t    payment_id;
+      uint64_t    descr_key;
+   };
+
+   // leading fields of the notify action sent on invoice changes
+   struct notification {
+      name        invoice_status;
+      std::string message;
+      uint64_t    invoice_id;
+      name        created_by;
+      uint64_t    descr_key;
+      std::string note;
+   };
+
+
+   const uint64_t FIRST_INVOICE_ID = 1ull << 32;
+   const uint8_t  STATUS_OPEN = 1;
+   const uint8_t  STATUS_PAID = 3;
+   const uint8_t  STATUS_REJECTED = 4;
+
+   // BRM created with 10000.000 issued to each of alice, bob and carol,
+   // staking configured as on the deployed contract and split into
+   // stakestate/settings
+   struct brm_tester : tester {
+      brm_tester() {
+         for( auto n : { issuer, alice, bob, carol } ) {
+            create_account( n );
+         }
+         put_row( "configs"_n, self.value, 0, legacy_config_row{ 0, 1, name(), 0, brm( 0 ), brm( 0 ), brm( 0 ), brm( 0 ), brm( 0 ), brm( 0 ), 0,
+                                                                 brm( 0 ), brm( 0 ), brm( 0 ), brm( 0 ), brm( 0 ), brm( 0 ), brm( 0 ), 0, 0 }, self );
+#ifndef BRM_NO_STAKING
+         push( "splitconfig"_n, { self } );
+#endif
+         push( "create"_n, { self }, issuer, brm( 1000000000000 ) );
+         for( auto n : { alice, bob, carol } ) {
+            push( "issue"_n, { issuer }, n, brm( 10000000 ), "" );
+         }
+      }
+
+      int64_t balance( name owner )const {
+         auto r = get_row<account_row>( "accounts"_n, owner.value, BRM.code().raw() );
+         return r ? r->balance.amount : -1;
+      }
+
+      int64_t supply()const {
+         return get_row<currency_stats_row>( "stat"_n, BRM.code().raw(), BRM.code().raw() )->supply.amount;
+      }
+
+      stake_state_row state()const {
+         return get_row<stake_state_row>( "stakestate"_n, self.value, "stakestate"_n.value ).value();
+      }
+
+      void put_state( const stake_state_row& state ) {
+         put_row( "stakestate"_n, self.value, "stakestate"_n.value, state, self );
+      }
+
+      std::optional<stake_row> stake_of( name owner )const {
+         return get_row<stake_row>( "stakebals"_n, owner.value, BRM.code().raw() );
+      }
+
+      std::optional<lock_row> locks_of( name owner )const {
+         return get_row<lock_row>( "locks"_n, owner.value, BRM.code().raw() );
+      }
+
+      int64_t locked( name owner )const {
+         int64_t total = 0;
+         if( auto l = locks_of( owner ) ) {
+            for( const auto& t : l->tranches ) {
+               total += t.amount;
+            }
+         }
+         return total;
+      }
+
+      std::optional<allowance_row> allowance_of( name customer, name merchant )const {
+         return get_row<allowance_row>( "allowances"_n, customer.value, merchant.value );
+      }
+
+      std::optional<recurring_row> template_of( name merchant, uint64_t id )const {
+         return get_row<recurring_row>( "rtemplates"_n, merchant.value, id );
+      }
+
+      std::optional<invoice_row> invoice( name merchant, uint64_t id )const {
+         return get_row<invoice_row>( "minvoices"_n, merchant.value, id );
+      }
+
+      std::optional<descr_row> descr( uint64_t key )const {
+         return get_row<descr_row>( "descrs"_n, self.value, key );
+      }
+   };
+
+}
+
+/***** token **************************/
+
+TEST( transfer_moves_balance )
+{
+   brm_tester t;
+   t.push( "transfer"_n, { alice }, alice, bob, brm( 2500 ), "rent" );
+   CHECK( t.balance( alice ) == 10000000 - 2500 );
+   CHECK( t.balance( bob ) == 10000000 + 2500 );
+   CHECK( t.recipients().size() == 2 );
+}
+
+TEST( failed_transfer_rolls_back )
+{
+   brm_tester t;
+   CHECK_ASSERT( "overdrawn balance", t.push( "transfer"_n, { alice }, alice, bob, brm( 10000001 ), "" ) );
+   CHECK_ASSERT( "missing authority of alice", t.push( "transfer"_n, { bob }, alice, bob, brm( 1 ), "" ) );
+   CHECK_ASSERT( "cannot transfer to self", t.push( "transfer"_n, { alice }, alice, alice, brm( 1 ), "" ) );
+   CHECK( t.balance( alice ) == 10000000 );
+   CHECK( t.balance( bob ) == 10000000 );
+}
+
+TEST( transfer_to_new_account_is_paid_by_sender )
+{
+   brm_tester t;
+   name dave = name("dave");
+   t.create_account( dave );
+   t.push( "transfer"_n, { alice }, alice, dave, brm( 1 ), "" );
+   CHECK( t.find_row( "accounts"_n, dave.value, BRM.code().raw() )->payer == alice.value );
+}
+
+TEST( transfer_decodes_in_place )
+{
+   brm_tester t;
+   CHECK_ASSERT( "memo has more than 256 bytes", t.push( "transfer"_n, { alice }, alice, bob, brm( 1 ), std::string( 600, 'm' ) ) );
+   CHECK_ASSERT( "read", t.push( "transfer"_n, { alice }, alice, bob ) );
+   t.push( "transfer"_n, { alice }, alice, bob, brm( 1 ), std::string( 256, 'm' ) );
+   CHECK( t.balance( alice ) == 10000000 - 1 );
+}
+
+TEST( transferc_sends_raw_units )
+{
+   brm_tester t;
+   t.push( "transferc"_n, { alice }, alice, bob, unsigned_int( 700 ) );
+   CHECK( t.balance( alice ) == 10000000 - 700 );
+   CHECK( t.balance( bob ) == 10000000 + 700 );
+   CHECK( (t.recipients() == std::vector<uint64_t>{ alice.value, bob.value }) );
+   CHECK_ASSERT( "overdrawn balance", t.push( "transferc"_n, { alice }, alice, bob, unsigned_int( 10000000 ) ) );
+}
+
+TEST( transfermany_merges_recipients )
+{
+   brm_tester t;
+   std::vector<transfer_entry> transfers = {
+      { bob, brm( 100 ), "a" }, { carol, brm( 50 ), "b" }, { bob, brm( 25 ), "c" }
+   };
+   t.push( "transfermany"_n, { alice }, alice, BRM, transfers );
+   CHECK( t.balance( alice ) == 10000000 - 175 );
+   CHECK( t.balance( bob ) == 10000000 + 125 );
+   CHECK( t.balance( carol ) == 10000000 + 50 );
+}
+
+TEST( symbols_are_checked )
+{
+   brm_tester t;
+   const symbol SYS = symbol("SYS", 4);
+   CHECK_ASSERT( "symbol precision mismatch", t.push( "transfer"_n, { alice }, alice, bob, asset( 1, symbol("BRM", 4) ), "" ) );
+#ifdef BRM_SINGLE_TOKEN
+   CHECK_ASSERT( "this build only supports the BRM token", t.push( "create"_n, { self }, issuer, asset( 1000, SYS ) ) );
+#else
+   t.push( "create"_n, { self }, issuer, asset( 1000, SYS ) );
+   t.push( "issue"_n, { issuer }, alice, asset( 10, SYS ), "" );
+   t.push( "transfer"_n, { alice }, alice, bob, asset( 10, SYS ), "" );
+#ifndef BRM_NO_STAKING
+   CHECK_ASSERT( "only BRM can be staked", t.push( "stake"_n, { bob }, bob, asset( 10, SYS ) ) );
+#endif
+#endif
+}
+
+TEST( issuemany_merges_and_bills_ram_payer )
+{
+   brm_tester t;
+   name dave = name("dave"), erin = name("erin"), payer = name("payer");
+   for( auto n : { dave, erin, payer } ) {
+      t.create_account( n );
+   }
+   std::vector<issue_entry> issues = { { erin, brm( 10 ) }, { dave, brm( 20 ) }, { erin, brm( 5 ) }, { alice, brm( 1 ) } };
+   CHECK_ASSERT( "missing authority of payer", t.push( "issuemany"_n, { issuer }, BRM, payer, issues ) );
+   CHECK_ASSERT( "missing authority of issuer", t.push( "issuemany"_n, { payer }, BRM, payer, issues ) );
+
+   t.push( "issuemany"_n, { issuer, payer }, BRM, payer, issues );
+   CHECK( t.supply() == 30000000 + 36 );
+   CHECK( t.balance( erin ) == 15 && t.balance( dave ) == 20 && t.balance( alice ) == 10000001 );
+   CHECK( t.balance( issuer ) == -1 );
+   // one row and one notification per recipient, only new rows billed to payer
+   CHECK( t.recipients().size() == 3 );
+   CHECK( t.find_row( "accounts"_n, erin.value, BRM.code().raw() )->payer == payer.value );
+   CHECK( t.find_row( "accounts"_n, dave.value, BRM.code().raw() )->payer == payer.value );
+   CHECK( t.find_row( "accounts"_n, alice.value, BRM.code().raw() )->payer == issuer.value );
+   CHECK( eosio_test::chain().ram_usage[payer.value] == 2 * (16 + eosio_test::row_overhead) );
+}
+
+TEST( issuemany_checks_supply )
+{
+   brm_tester t;
+   int64_t left = 1000000000000 - 30000000;
+   auto issue = [&]( std::vector<issue_entry> issues ) {
+      t.push( "issuemany"_n, { issuer }, BRM, issuer, issues );
+   };
+   CHECK_ASSERT( "quantity exceeds available supply", issue( { { alice, brm( left ) }, { bob, brm( 1 ) } } ) );
+   CHECK_ASSERT( "symbol precision mismatch", issue( { { alice, asset( 1, symbol("BRM", 4) ) } } ) );
+   CHECK_ASSERT( "must issue positive quantity", issue( { { alice, brm( 1 ) }, { bob, brm( 0 ) } } ) );
+   CHECK_ASSERT( "no recipients given", issue( {} ) );
+   CHECK( t.supply() == 30000000 && t.balance( alice ) == 10000000 );
+
+   issue( { { alice, brm( left - 1 ) }, { bob, brm( 1 ) } } );
+   CHECK( t.supply() == 1000000000000 );
+}
+
+TEST( issuemany_ignores_recipient_order )
+{
+   name dave = name("dave");
+   std::vector<issue_entry> issues = { { carol, brm( 3 ) }, { dave, brm( 4 ) }, { bob, brm( 5 ) }, { carol, brm( 6 ) } };
+   auto run = [&]( const std::vector<issue_entry>& order ) {
+      brm_tester t;
+      t.create_account( dave );
+      t.push( "issuemany"_n, { issuer }, BRM, issuer, order );
+      std::vector<int64_t> balances;
+      for( auto n : { bob, carol, dave } ) {
+         balances.push_back( t.balance( n ) );
+      }
+      return std::make_tuple( balances, t.recipients(), eosio_test::chain().ram_usage );
+   };
+   auto first = run( issues );
+   std::reverse( issues.begin(), issues.end() );
+   CHECK( run( issues ) == first );
+   std::rotate( issues.begin(), issues.begin() + 1, issues.end() );
+   CHECK( run( issues ) == first );
+   CHECK( std::get<0>( first ) == (std::vector<int64_t>{ 10000005, 10000009, 4 }) );
+}
+
+TEST( issue_and_retire_track_supply )
+{
+   brm_tester t;
+   CHECK( t.supply() == 30000000 );
+   t.push( "issue"_n, { issuer }, issuer, brm( 500 ), "" );
+   t.push( "retire"_n, { issuer }, brm( 200 ), "" );
+   CHECK( t.supply() == 30000300 );
+   CHECK( t.balance( issuer ) == 300 );
+   // credited straight to the recipient, who is notified on issue itself
+   t.push( "issue"_n, { issuer }, alice, brm( 7 ), "" );
+   CHECK( t.balance( alice ) == 10000007 && t.balance( issuer ) == 300 );
+   CHECK( t.recipients() == std::vector<uint64_t>{ alice.value } && t.sent().empty() );
+   CHECK_ASSERT( "quantity exceeds available supply", t.push( "issue"_n, { issuer }, alice, brm( 1000000000000 ), "" ) );
+}
+
+TEST( close_needs_zero_balance )
+{
+   brm_tester t;
+   CHECK_ASSERT( "Cannot close because the balance is not zero", t.push( "close"_n, { alice }, alice, BRM ) );
+   t.push( "transfer"_n, { alice }, alice, bob, brm( 10000000 ), "" );
+   t.push( "close"_n, { alice }, alice, BRM );
+   CHECK( t.balance( alice ) == -1 );
+}
+
+TEST( closemany_closes_zero_balances )
+{
+   brm_tester t;
+   name dave = name("dave");
+   t.create_account( dave );
+   std::vector<symbol> symbols = { BRM };
+#ifndef BRM_SINGLE_TOKEN
+   const symbol SYS = symbol("SYS", 4);
+   t.push( "create"_n, { self }, issuer, asset( 1000, SYS ) );
+   t.push( "open"_n, { dave }, dave, SYS, dave );
+   symbols.push_back( SYS );
+#endif
+   t.push( "open"_n, { dave }, dave, BRM, dave );
+   CHECK_ASSERT( "Cannot close because the balance is not zero", t.push( "closemany"_n, { alice }, alice, std::vector<symbol>{ BRM } ) );
+   CHECK_ASSERT( "Balance row already deleted", t.push( "closemany"_n, { dave }, dave, std::vector<symbol>{ BRM, BRM } ) );
+   CHECK( t.balance( dave ) == 0 );
+   t.push( "closemany"_n, { dave }, dave, symbols );
+   CHECK( t.row_count( "accounts"_n, dave.value ) == 0 );
+}
+
+TEST( sweep_erases_consented_zero_balances )
+{
+   brm_tester t;
+   name dave = name("dave"), erin = name("erin");
+   for( auto n : { dave, erin } ) {
+      t.create_account( n );
+      t.push( "open"_n, { n }, n, BRM, n );
+   }
+   // carol empties her balance but does not consent, alice consents but
+   // still holds BRM
+   t.push( "transfer"_n, { carol }, carol, alice, brm( 10000000 ), "" );
+   for( auto n : { alice, dave, erin } ) {
+      t.push( "allowsweep"_n, { n }, n );
+   }
+   CHECK_ASSERT( "sweep already allowed", t.push( "allowsweep"_n, { dave }, dave ) );
+   CHECK_ASSERT( "missing authority of erin", t.push( "allowsweep"_n, { bob }, erin ) );
+
+   // the budget runs out after alice and dave, erin's consent is left
+   // for the next call
+   t.push( "sweep"_n, { bob }, uint32_t(2) );
+   CHECK( t.balance( alice ) == 20000000 && t.balance( dave ) == -1 && t.balance( erin ) == 0 );
+   CHECK( t.row_count( "sweeps"_n, self.value ) == 1 );
+   t.push( "sweep"_n, { bob }, uint32_t(2) );
+   CHECK( t.balance( erin ) == -1 && t.balance( carol ) == 0 );
+   CHECK( t.row_count( "sweeps"_n, self.value ) == 0 );
+   CHECK_ASSERT( "Nothing to sweep", t.push( "sweep"_n, { bob }, uint32_t(2) ) );
+}
+
+#ifndef BRM_SINGLE_TOKEN
+TEST( sweep_resumes_within_an_owner )
+{
+   brm_tester t;
+   name dave = name("dave");
+   const symbol SYS = symbol("SYS", 4);
+   t.create_account( dave );
+   t.push( "create"_n, { self }, issuer, asset( 1000, SYS ) );
+   t.push( "open"_n, { dave }, dave, BRM, dave );
+   t.push( "open"_n, { dave }, dave, SYS, dave );
+   t.push( "allowsweep"_n, { dave }, dave );
+
+   t.push( "sweep"_n, { bob }, uint32_t(1) );
+   CHECK( t.row_count( "accounts"_n, dave.value ) == 1 );
+   CHECK( t.row_count( "sweeps"_n, self.value ) == 1 );
+   t.push( "sweep"_n, { bob }, uint32_t(1) );
+   CHECK( t.row_count( "accounts"_n, dave.value ) == 0 );
+   CHECK( t.row_count( "sweeps"_n, self.value ) == 0 );
+}
+#endif
+
+/***** staking **************************/
+
+#ifndef BRM_NO_STAKING
+
+TEST( unstake_locks_until_due )
+{
+   brm_tester t;
+   t.push( "stake"_n, { alice }, alice, brm( 1000 ) );
+   CHECK( t.balance( alice ) == 10000000 - 1000 );
+   t.push( "unstake"_n, { alice }, alice, brm( 400 ) );
+   CHECK( t.stake_of( alice )->staked == 600 );
+   CHECK( t.locks_of( alice )->tranches.size() == 1 );
+   CHECK( t.locks_of( alice )->tranches[0].due == t.now() + TENDAY_WAIT );
+   CHECK_ASSERT( "You need to wait until lock period is over!", t.push( "refund"_n, { alice }, alice ) );
+
+   t.advance( TENDAY_WAIT + 1 );
+   t.push( "refund"_n, { alice }, alice );
+   CHECK( !t.locks_of( alice ) );
+   CHECK( t.balance( alice ) == 10000000 - 600 );
+
+   t.push( "unstake"_n, { alice }, alice, brm( 600 ) );
+   CHECK( !t.stake_of( alice ) );
+   CHECK( t.state().total_staked == 0 && t.state().total_shares == 0 );
+}
+
+TEST( refund_releases_matured_tranches )
+{
+   brm_tester t;
+   t.push( "stake"_n, { alice }, alice, brm( 1000 ) );
+   t.push( "unstake"_n, { alice }, alice, brm( 100 ) );
+   t.advance( 60 * 60 * 24 );
+   t.push( "unstake"_n, { alice }, alice, brm( 200 ) );
+   t.push( "unstake"_n, { alice }, alice, brm( 300 ) );
+   CHECK( t.locks_of( alice )->tranches.size() == 2 );
+   CHECK( t.locked( alice ) == 600 );
+
+   t.advance( TENDAY_WAIT - 60 * 60 * 24 + 1 );
+   t.push( "refund"_n, { alice }, alice );
+   CHECK( t.balance( alice ) == 10000000 - 1000 + 100 );
+   CHECK( t.locks_of( alice )->tranches.size() == 1 && t.locked( alice ) == 500 );
+}
+
+TEST( full_lock_queue_folds_into_newest_tranche )
+{
+   brm_tester t;
+   t.push( "stake"_n, { alice }, alice, brm( 1000 ) );
+   for( int i = 1; i <= 18; ++i ) {
+      t.push( "unstake"_n, { alice }, alice, brm( i ) );
+      t.advance( 1 );
+   }
+   // the 17th and 18th unstake went into the 16th tranche, due with the last
+   auto locks = t.locks_of( alice ).value();
+   CHECK( locks.tranches.size() == 16 );
+   CHECK( locks.tranches[14].amount == 15 && locks.tranches[14].due == t.now() - 4 + TENDAY_WAIT );
+   CHECK( locks.tranches[15].amount == 16 + 17 + 18 && locks.tranches[15].due == t.now() - 1 + TENDAY_WAIT );
+   CHECK( t.locked( alice ) == 18 * 19 / 2 );
+}
+
+TEST( refundmany_releases_across_owners )
+{
+   brm_tester t;
+   t.push( "stake"_n, { alice }, alice, brm( 1000 ) );
+   t.push( "stake"_n, { bob }, bob, brm( 1000 ) );
+   t.push( "stake"_n, { carol }, carol, brm( 1000 ) );
+   t.push( "unstake"_n, { alice }, alice, brm( 100 ) );
+   t.push( "unstake"_n, { bob }, bob, brm( 200 ) );
+   t.advance( 60 * 60 * 24 );
+   t.push( "unstake"_n, { bob }, bob, brm( 50 ) );
+   t.push( "unstake"_n, { carol }, carol, brm( 300 ) );
+   t.advance( TENDAY_WAIT - 60 * 60 * 24 + 1 );
+
+   CHECK_ASSERT( "missing authority of brmtoken", t.push( "refundmany"_n, { alice }, std::vector<name>{ alice } ) );
+   CHECK_ASSERT( "no accounts given", t.push( "refundmany"_n, { self }, std::vector<name>{} ) );
+   // carol has nothing due yet and the contract no lock at all, both are skipped
+   t.push( "refundmany"_n, { self }, std::vector<name>{ alice, carol, bob, self } );
+   CHECK( !t.locks_of( alice ) && t.balance( alice ) == 10000000 - 900 );
+   CHECK( t.locked( bob ) == 50 && t.balance( bob ) == 10000000 - 800 );
+   CHECK( t.locked( carol ) == 300 && t.balance( carol ) == 10000000 - 1000 );
+}
+
+TEST( refundmany_pays_for_reopened_balances )
+{
+   brm_tester t;
+   t.push( "stake"_n, { alice }, alice, brm( 10000000 ) );
+   t.push( "close"_n, { alice }, alice, BRM );
+   t.push( "unstake"_n, { alice }, alice, brm( 400 ) );
+   t.advance( TENDAY_WAIT + 1 );
+
+   t.push( "refundmany"_n, { self }, std::vector<name>{ alice } );
+   CHECK( t.balance( alice ) == 400 );
+   CHECK( t.find_row( "accounts"_n, alice.value, BRM.code().raw() )->payer == self.value );
+}
+
+TEST( debit_releases_matured_tranches )
+{
+   brm_tester t;
+   t.push( "stake"_n, { alice }, alice, brm( 10000000 ) );
+   t.push( "unstake"_n, { alice }, alice, brm( 4000 ) );
+   CHECK( t.balance( alice ) == 0 );
+   CHECK_ASSERT( "overdrawn balance", t.push( "transfer"_n, { alice }, alice, bob, brm( 3000 ), "" ) );
+
+   // only covered by the matured tranche, released by the debit itself
+   t.advance( TENDAY_WAIT + 1 );
+   t.push( "transfer"_n, { alice }, alice, bob, brm( 3000 ), "" );
+   CHECK( t.balance( alice ) == 1000 );
+   CHECK( t.balance( bob ) == 10000000 + 3000 );
+   CHECK( !t.locks_of( alice ) );
+}
+
+TEST( rewards_follow_shares )
+{
+   brm_tester t;
+   t.push( "transfer"_n, { carol }, carol, self, brm( 1000 ), "" );
+   t.push( "stake"_n, { alice }, alice, brm( 1000 ) );
+   t.push( "stake"_n, { bob }, bob, brm( 3000 ) );
+   t.push( "distribute"_n, { self }, brm( 400 ) );
+   CHECK( t.balance( self ) == 600 );
+   CHECK( t.state().unclaimed_tokens == 400 );
+
+   t.push( "claimreward"_n, { alice }, alice );
+   t.push( "claimreward"_n, { bob }, bob );
+   CHECK( t.balance( alice ) == 10000000 - 1000 + 100 );
+   CHECK( t.balance( bob ) == 10000000 - 3000 + 300 );
+   CHECK( t.state().unclaimed_tokens == 0 );
+   CHECK_ASSERT( "Nothing to claim", t.push( "claimreward"_n, { alice }, alice ) );
+}
+
+#ifndef BRM_SINGLE_TOKEN
+TEST( rewards_are_paid_in_brm_only )
+{
+   brm_tester t;
+   const symbol SYS = symbol("SYS", 4);
+   t.push( "create"_n, { self }, issuer, asset( 100000000, SYS ) );
+   t.push( "issue"_n, { issuer }, self, asset( 5000000, SYS ), "" );
+   t.push( "stake"_n, { alice }, alice, brm( 1000 ) );
+   CHECK_ASSERT( "only BRM can be distributed", t.push( "distribute"_n, { self }, asset( 5000000, SYS ) ) );
+   CHECK( t.state().reward_per_share == 0 && t.state().unclaimed_tokens == 0 );
+   CHECK_ASSERT( "Nothing to claim", t.push( "claimreward"_n, { alice }, alice ) );
+   CHECK( t.supply() == 30000000 );
+}
+#endif
+
+TEST( full_unstake_pays_out_rewards )
+{
+   brm_tester t;
+   t.push( "transfer"_n, { carol }, carol, self, brm( 1000 ), "" );
+   t.push( "stake"_n, { alice }, alice, brm( 1000 ) );
+   t.push( "distribute"_n, { self }, brm( 200 ) );
+   // a new stake settles what the old one earned first
+   t.push( "stake"_n, { bob }, bob, brm( 1000 ) );
+   t.push( "stake"_n, { alice }, alice, brm( 1000 ) );
+   CHECK( t.stake_of( alice )->escrow == 200 );
+   t.push( "distribute"_n, { self }, brm( 300 ) );
+
+   t.push( "unstake"_n, { alice }, alice, brm( 2000 ) );
+   CHECK( t.balance( alice ) == 10000000 - 2000 + 400 );
+   CHECK( t.locked( alice ) == 2000 );
+   CHECK( t.state().unclaimed_tokens == 100 );
+}
+
+TEST( getpositions_reports_each_owner )
+{
+   brm_tester t;
+   t.push( "transfer"_n, { carol }, carol, self, brm( 1000 ), "" );
+   t.push( "stake"_n, { alice }, alice, brm( 1000 ) );
+   t.push( "unstake"_n, { alice }, alice, brm( 500 ) );
+   t.push( "distribute"_n, { self }, brm( 200 ) );
+   CHECK_ASSERT( "no accounts given", t.push( "getpositions"_n, { alice }, std::vector<name>{} ) );
+
+   name dave = name("dave");
+   t.push( "getpositions"_n, { alice }, std::vector<name>{ alice, dave } );
+   const auto& hex = t.console();
+   std::vector<char> packed;
+   for( size_t i = 0; i + 1 < hex.size(); i += 2 ) {
+      packed.push_back( char( std::stoi( hex.substr( i, 2 ), nullptr, 16 ) ) );
+   }
+   auto positions = eosio::unpack<std::vector<account_position>>( packed.data(), packed.size() );
+   CHECK( positions.size() == 2 );
+
+   const auto& a = positions[0];
+   auto stake = t.stake_of( alice ).value();
+   CHECK( a.owner == alice && a.balance == brm( 10000000 - 1000 ) );
+   CHECK( a.staked == brm( 500 ) && a.stake_period == stake.stake_period && a.stake_due == stake.stake_due );
+   CHECK( a.locked == brm( 500 ) && a.refund_due == t.now() + TENDAY_WAIT );
+   CHECK( a.pending_reward == brm( 200 ) );
+
+   const auto& d = positions[1];
+   CHECK( d.owner == dave && d.balance == brm( 0 ) && d.staked == brm( 0 ) && d.locked == brm( 0 ) );
+   CHECK( d.stake_due == 0 && d.refund_due == 0 && d.pending_reward == brm( 0 ) );
+}
+
+TEST( splitconfig_moves_the_legacy_row )
+{
+   brm_tester t;
+   CHECK( t.row_count( "configs"_n, self.value ) == 0 );
+   t.put_row( "configs"_n, self.value, 0, legacy_config_row{ 0, 1, alice, 3, brm( 10 ), brm( 20 ), brm( 30 ), brm( 60 ), brm( 0 ), brm( 0 ), 95,
+                                                            brm( 0 ), brm( 0 ), brm( 7 ), brm( 0 ), brm( 5 ), brm( 0 ), brm( 0 ), 42, 0 }, self );
+   CHECK_ASSERT( "stakestate already initialised", t.push( "splitconfig"_n, { self } ) );
+
+   t.erase_row( "stakestate"_n, self.value, "stakestate"_n.value );
+   CHECK_ASSERT( "missing authority of brmtoken", t.push( "splitconfig"_n, { alice } ) );
+   t.push( "splitconfig"_n, { self } );
+   // only the staked totals are kept, the other counters are rebuilt by
+   // migratestake
+   auto state = t.state();
+   CHECK( state.staked_weekly == 10 && state.staked_monthly == 20 && state.staked_quarterly == 30 && state.total_staked == 60 );
+   CHECK( state.active_accounts == 0 && state.total_shares == 0 && state.reward_per_share == 0 );
+   CHECK( state.total_payout == 0 && state.unclaimed_tokens == 0 );
+   CHECK( t.row_count( "configs"_n, self.value ) == 0 );
+}
+
+TEST( staking_waits_for_splitconfig )
+{
+   brm_tester t;
+   t.erase_row( "stakestate"_n, self.value, "stakestate"_n.value );
+   t.push( "transfer"_n, { carol }, carol, self, brm( 100 ), "" );
+   CHECK_ASSERT( "staking is not configured", t.push( "stake"_n, { alice }, alice, brm( 1000 ) ) );
+   CHECK_ASSERT( "staking is not configured", t.push( "distribute"_n, { self }, brm( 100 ) ) );
+   CHECK_ASSERT( "staking is not configured", t.push( "migratestake"_n, { self }, uint32_t(10) ) );
+   CHECK( t.row_count( "stakestate"_n, self.value ) == 0 );
+
+   // a fresh deployment has no configs row to move
+   t.push( "splitconfig"_n, { self } );
+   auto state = t.state();
+   CHECK( state.active_accounts == 0 && state.total_shares == 0 && state.reward_per_share == 0 );
+   t.push( "stake"_n, { alice }, alice, brm( 1000 ) );
+   CHECK( t.state().total_staked == 1000 );
+   CHECK_ASSERT( "stakestate already initialised", t.push( "splitconfig"_n, { self } ) );
+}
+
+TEST( migration_moves_legacy_positions )
+{
+   brm_tester t;
+   // as the deployed stake leaves things: bob staked 500, alice 200 in
+   // two calls, each one bumping active_accounts, and no total_shares
+   t.erase_row( "stakestate"_n, self.value, "stakestate"_n.value );
+   t.erase_row( "settings"_n, self.value, "settings"_n.value );
+   t.put_row( "configs"_n, self.value, 0, legacy_config_row{ 0, 1, name(), 3, brm( 700 ), brm( 0 ), brm( 0 ), brm( 700 ), brm( 0 ), brm( 0 ), 0,
+                                                            brm( 0 ), brm( 0 ), brm( 0 ), brm( 0 ), brm( 0 ), brm( 0 ), brm( 0 ), 0, 0 }, self );
+   t.put_row( "stakes"_n, self.value, bob.value, legacy_stake_row{ bob, 1, brm( 500 ), t.now(), t.now(), brm( 0 ) }, self );
+   t.put_row( "stakes"_n, self.value, alice.value, legacy_stake_row{ alice, 1, brm( 200 ), t.now(), t.now(), brm( 0 ) }, self );
+   t.put_row( "accounts"_n, bob.value, BRM.code().raw(), account_row{ brm( 10000000 - 500 ) }, bob );
+   t.put_row( "accounts"_n, alice.value, BRM.code().raw(), account_row{ brm( 10000000 - 200 ) }, alice );
+   t.put_row( "lockedbals"_n, alice.value, alice.value, legacy_lock_row{ alice, brm( 50 ), t.now() + 10 }, self );
+   t.put_row( "lockedbals"_n, bob.value, bob.value, legacy_lock_row{ bob, brm( 0 ), t.now() }, self );
+   t.push( "splitconfig"_n, { self } );
+
+   // alice opens a new position next to her legacy one
+   t.push( "stake"_n, { alice }, alice, brm( 1000 ) );
+   t.push( "unstake"_n, { alice }, alice, brm( 100 ) );
+   t.push( "transfer"_n, { carol }, carol, self, brm( 1600 ), "" );
+   CHECK_ASSERT( "legacy stakes are not migrated yet", t.push( "distribute"_n, { self }, brm( 1600 ) ) );
+
+   CHECK_ASSERT( "missing authority of brmtoken", t.push( "migratestake"_n, { alice }, uint32_t(10) ) );
+   t.push( "migratestake"_n, { self }, uint32_t(1) );
+   t.push( "migratestake"_n, { self }, uint32_t(10) );
+   CHECK_ASSERT( "Nothing to migrate", t.push( "migratestake"_n, { self }, uint32_t(10) ) );
+   CHECK( t.stake_of( alice )->staked == 1100 && t.stake_of( bob )->staked == 500 );
+   CHECK( t.state().total_shares == 1600 && t.state().total_staked == 1600 && t.state().active_accounts == 2 );
+
+   // one reward per share, shared by everything staked
+   t.push( "distribute"_n, { self }, brm( 1600 ) );
+   t.push( "claimreward"_n, { bob }, bob );
+   t.push( "claimreward"_n, { alice }, alice );
+   int64_t paid = ( t.balance( bob ) - ( 10000000 - 500 ) ) + ( t.balance( alice ) - ( 10000000 - 200 - 1000 ) );
+   CHECK( t.balance( bob ) == 10000000 - 500 + 500 );
+   CHECK( paid == 1600 && t.state().unclaimed_tokens == 0 );
+
+   // the rebuilt counters reconcile
+   t.push( "audit"_n, { self }, std::vector<name>{ alice, bob }, true );
+   t.push( "audit"_n, { self }, std::vector<name>{ self, carol }, true );
+   t.push( "audit"_n, { self }, std::vector<name>{}, true );
+
+   t.push( "migratelocks"_n, { self }, std::vector<name>{ alice, bob } );
+   CHECK( t.row_count( "lockedbals"_n, alice.value ) == 0 && t.row_count( "lockedbals"_n, bob.value ) == 0 );
+   CHECK( !t.locks_of( bob ) );
+   auto locks = t.locks_of( alice );
+   CHECK( locks->tranches.size() == 2 && locks->tranches[0].due == t.now() + 10 && t.locked( alice ) == 150 );
+
+   // the migrated shares leave with the positions
+   t.push( "unstake"_n, { bob }, bob, brm( 500 ) );
+   t.push( "unstake"_n, { alice }, alice, brm( 1100 ) );
+   CHECK( t.state().total_shares == 0 && t.state().total_staked == 0 && t.state().active_accounts == 0 );
+}
+
+TEST( audit_reconciles_supply_in_batches )
+{
+   brm_tester t;
+   t.push( "transfer"_n, { carol }, carol, self, brm( 1000 ), "" );
+   t.push( "stake"_n, { alice }, alice, brm( 1000 ) );
+   t.push( "stake"_n, { bob }, bob, brm( 2000 ) );
+   t.push( "stake"_n, { bob }, bob, brm( 500 ) );
+   t.push( "unstake"_n, { alice }, alice, brm( 300 ) );
+   t.push( "distribute"_n, { self }, brm( 400 ) );
+   CHECK( t.state().active_accounts == 2 );
+
+   // the owner scopes as get_table_by_scope lists them, in two batches;
+   // the empty batch closes the audit
+   std::vector<name> owners = { alice, bob, self, carol };
+   t.push( "audit"_n, { self }, std::vector<name>{ alice, bob }, true );
+   CHECK_ASSERT( "owners must be in ascending order", t.push( "audit"_n, { self }, std::vector<name>{ bob, self }, true ) );
+   t.push( "audit"_n, { self }, std::vector<name>{ self, carol }, true );
+   CHECK( t.row_count( "auditstate"_n, self.value ) == 1 );
+   t.push( "audit"_n, { self }, std::vector<name>{}, true );
+   CHECK( t.row_count( "auditstate"_n, self.value ) == 0 );
+   CHECK( t.console().find( "supply 30000000 accounted 30000000" ) != std::string::npos );
+   CHECK_ASSERT( "missing authority of brmtoken", t.push( "audit"_n, { alice }, owners, false ) );
+
+   auto state = t.state();
+   state.active_accounts += 1;
+   t.put_state( state );
+   t.push( "audit"_n, { self }, owners, false );
+   t.push( "audit"_n, { self }, std::vector<name>{}, false );
+   CHECK( t.console().find( "active_accounts 3 counted 2" ) != std::string::npos );
+   t.push( "audit"_n, { self }, owners, true );
+   CHECK_ASSERT( "audit found mismatching totals", t.push( "audit"_n, { self }, std::vector<name>{}, true ) );
+}
+
+#endif
+
+/***** invoices **************************/
+
+#ifndef BRM_NO_INVOICES
+
+TEST( invoice_pay_and_purge )
+{
+   brm_tester t;
+   t.push( "sendinvoice"_n, { alice }, alice, bob, brm( 1500 ), t.now(), "march" );
+   t.push( "sendinvoice"_n, { alice }, alice, carol, brm( 10 ), t.now(), "" );
+   auto inv = t.invoice( alice, FIRST_INVOICE_ID );
+   CHECK( inv && inv->invoice_status == STATUS_OPEN && inv->to_account == bob );
+   CHECK( t.descr( inv->descr_key )->text == "march" );
+   CHECK( t.invoice( alice, FIRST_INVOICE_ID + 1 )->descr_key == 0 );
+
+   CHECK_ASSERT( "Partial/Over Payments not allowed", t.push( "payinvoice"_n, { bob }, bob, FIRST_INVOICE_ID, brm( 1000 ) ) );
+   t.push( "payinvoice"_n, { bob }, bob, FIRST_INVOICE_ID, brm( 1500 ) );
+   CHECK( t.balance( bob ) == 10000000 - 1500 );
+   CHECK( t.balance( alice ) == 10000000 + 1500 );
+   inv = t.invoice( alice, FIRST_INVOICE_ID );
+   CHECK( inv->invoice_status == STATUS_PAID && inv->paid_total == brm( 1500 ) && inv->payment_id == 1 );
+   CHECK( t.row_count( "cinvoices"_n, bob.value ) == 0 );
+   CHECK_ASSERT( "Account has no such invoice", t.push( "payinvoice"_n, { bob }, bob, FIRST_INVOICE_ID, brm( 1500 ) ) );
+
+   // only the settled invoice goes, with its description and index entries
+   CHECK_ASSERT( "missing authority of merchant", t.push( "purgeinvs"_n, { bob }, alice, t.now() + 1, uint32_t(10) ) );
+   CHECK_ASSERT( "Nothing to purge", t.push( "purgeinvs"_n, { alice }, alice, t.now(), uint32_t(10) ) );
+   t.push( "purgeinvs"_n, { alice }, alice, t.now() + 1, uint32_t(10) );
+   CHECK( !t.invoice( alice, FIRST_INVOICE_ID ) && t.invoice( alice, FIRST_INVOICE_ID + 1 ) );
+   CHECK( t.row_count( "descrs"_n, self.value ) == 0 );
+   CHECK( t.index_count( "minvoices"_n, 0, alice.value ) == 1 && t.index_count( "minvoices"_n, 1, alice.value ) == 1 );
+}
+
+TEST( long_description_is_read_from_the_heap )
+{
+   brm_tester t;
+   // past 512 bytes of action data the in place decoder mallocs its buffer
+   std::string descr( 600, 'd' );
+   t.push( "sendinvoice"_n, { alice }, alice, bob, brm( 1 ), t.now(), descr );
+   CHECK( t.descr( t.invoice( alice, FIRST_INVOICE_ID )->descr_key )->text == descr );
+}
+
+TEST( invoice_ids_count_up )
+{
+   brm_tester t;
+   t.push( "sendinvoice"_n, { alice }, alice, bob, brm( 1 ), t.now(), "" );
+   t.push( "sendinvoice"_n, { carol }, carol, bob, brm( 2 ), t.now(), "" );
+   CHECK( t.invoice( alice, FIRST_INVOICE_ID ) && t.invoice( carol, FIRST_INVOICE_ID + 1 ) );
+   t.push( "payinvoice"_n, { bob }, bob, FIRST_INVOICE_ID + 1, brm( 2 ) );
+   t.push( "payinvoice"_n, { bob }, bob, FIRST_INVOICE_ID, brm( 1 ) );
+   CHECK( t.invoice( carol, FIRST_INVOICE_ID + 1 )->payment_id == 1 );
+   CHECK( t.invoice( alice, FIRST_INVOICE_ID )->payment_id == 2 );
+}
+
+TEST( invoice_reject )
+{
+   brm_tester t;
+   t.push( "sendinvoice"_n, { alice }, alice, bob, brm( 1500 ), t.now(), "" );
+   t.push( "rejectinvoice"_n, { bob }, bob, FIRST_INVOICE_ID, "not mine" );
+   CHECK( t.invoice( alice, FIRST_INVOICE_ID )->invoice_status == STATUS_REJECTED );
+   // the reason only travels in the notification
+   CHECK( eosio::unpack<notification>( t.sent().back().data ).note == "reject:not mine" );
+   CHECK_ASSERT( "Account has no such invoice", t.push( "payinvoice"_n, { bob }, bob, FIRST_INVOICE_ID, brm( 1500 ) ) );
+   CHECK( t.balance( bob ) == 10000000 );
+}
+
+TEST( descriptions_are_shared )
+{
+   brm_tester t;
+   t.push( "sendinvoice"_n, { alice }, alice, bob, brm( 1 ), t.now(), "hosting" );
+   t.push( "sendinvoice"_n, { carol }, carol, bob, brm( 2 ), t.now(), "hosting" );
+   t.push( "sendrecurring"_n, { alice }, alice, carol, brm( 3 ), uint32_t(60 * 60 * 24), t.now() + 1, "hosting" );
+   auto key = t.invoice( alice, FIRST_INVOICE_ID )->descr_key;
+   CHECK( key != 0 && t.invoice( carol, FIRST_INVOICE_ID + 1 )->descr_key == key );
+   CHECK( t.template_of( alice, FIRST_INVOICE_ID + 2 )->descr_key == key );
+   CHECK( t.row_count( "descrs"_n, self.value ) == 1 && t.descr( key )->refs == 3 );
+   // notifications carry the key, not the text
+   CHECK( eosio::unpack<notification>( t.sent().back().data ).descr_key == key );
+
+   t.push( "payinvoice"_n, { bob }, bob, FIRST_INVOICE_ID, brm( 1 ) );
+   t.push( "purgeinvs"_n, { alice }, alice, t.now() + 1, uint32_t(10) );
+   CHECK( t.descr( key )->refs == 2 );
+   t.push( "endrecurring"_n, { alice }, alice, FIRST_INVOICE_ID + 2 );
+   CHECK( t.descr( key )->refs == 1 );
+   t.push( "rejectinvoice"_n, { bob }, bob, FIRST_INVOICE_ID + 1, "" );
+   t.push( "purgeinvs"_n, { carol }, carol, t.now() + 1, uint32_t(10) );
+   CHECK( !t.descr( key ) );
+}
+
+TEST( migrateinvs_moves_invoices_and_interns_text )
+{
+   brm_tester t;
+   // alice's invoices as the deployed contract stored them, under 4 byte
+   // hash ids: two open ones with the same text, one paid, one without text
+   const uint64_t ids[] = { 0x1a2b3c4d, 0x2b3c4d5e, 0x3c4d5e6f, 0x4d5e6f70 };
+   t.put_row( "uinvoices"_n, alice.value, ids[0], legacy_invoice_row{ ids[0], STATUS_OPEN, alice, bob, brm( 5 ), brm( 0 ), t.now(), 0, "", "power" }, self );
+   t.put_row( "uinvoices"_n, alice.value, ids[1], legacy_invoice_row{ ids[1], STATUS_OPEN, alice, bob, brm( 5 ), brm( 0 ), t.now(), 0, "", "power" }, self );
+   t.put_row( "uinvoices"_n, alice.value, ids[2], legacy_invoice_row{ ids[2], STATUS_PAID, alice, carol, brm( 7 ), brm( 7 ), t.now(), t.now(),
+                                                                       "18364758544493064720", "april" }, self );
+   t.put_row( "uinvoices"_n, alice.value, ids[3], legacy_invoice_row{ ids[3], STATUS_OPEN, alice, carol, brm( 9 ), brm( 0 ), t.now(), 0, "", "" }, self );
+   for( int i : { 0, 1 } ) {
+      t.put_row( "cinvoices"_n, bob.value, ids[i], std::make_tuple( ids[i], t.now(), alice ), self );
+   }
+   t.put_row( "cinvoices"_n, carol.value, ids[3], std::make_tuple( ids[3], t.now(), alice ), self );
+   CHECK_ASSERT( "Invoice not found", t.push( "payinvoice"_n, { bob }, bob, ids[0], brm( 5 ) ) );
+
+   CHECK_ASSERT( "missing authority of merchant", t.push( "migrateinvs"_n, { bob }, alice, uint32_t(10) ) );
+   t.push( "migrateinvs"_n, { alice }, alice, uint32_t(1) );
+   t.push( "migrateinvs"_n, { self }, alice, uint32_t(10) );
+   CHECK_ASSERT( "Nothing to migrate", t.push( "migrateinvs"_n, { alice }, alice, uint32_t(10) ) );
+   CHECK( t.row_count( "uinvoices"_n, alice.value ) == 0 );
+   auto inv = t.invoice( alice, ids[1] );
+   CHECK( inv && inv->invoice_status == STATUS_OPEN && inv->to_account == bob && inv->payment_id == 0 );
+   CHECK( t.descr( inv->descr_key )->text == "power" && t.descr( inv->descr_key )->refs == 2 );
+   inv = t.invoice( alice, ids[2] );
+   CHECK( inv->invoice_status == STATUS_PAID && inv->paid_total == brm( 7 ) && inv->payment_id == 18364758544493064720ull );
+   CHECK( t.descr( inv->descr_key )->text == "april" );
+   CHECK( t.invoice( alice, ids[3] )->descr_key == 0 );
+   CHECK( t.index_count( "minvoices"_n, 0, alice.value ) == 4 );
+
+   t.push( "payinvoice"_n, { bob }, bob, ids[0], brm( 5 ) );
+   CHECK( t.invoice( alice, ids[0] )->invoice_status == STATUS_PAID );
+   t.push( "payinvoice"_n, { carol }, carol, ids[3], brm( 9 ) );
+   CHECK( t.balance( alice ) == 10000000 + 14 );
+}
+
+TEST( migrateinvs_rejects_malformed_payment_ids )
+{
+   brm_tester t;
+   t.put_row( "uinvoices"_n, alice.value, 1, legacy_invoice_row{ 1, STATUS_PAID, alice, bob, brm( 5 ), brm( 5 ), t.now(), t.now(), "12x", "" }, self );
+   CHECK_ASSERT( "malformed payment id", t.push( "migrateinvs"_n, { alice }, alice, uint32_t(10) ) );
+   t.put_row( "uinvoices"_n, alice.value, 1, legacy_invoice_row{ 1, STATUS_PAID, alice, bob, brm( 5 ), brm( 5 ), t.now(), t.now(), "18446744073709551616", "" }, self );
+   CHECK_ASSERT( "malformed payment id", t.push( "migrateinvs"_n, { alice }, alice, uint32_t(10) ) );
+}
+
+TEST( collectinvs_pays_within_allowance )
+{
+   brm_tester t;
+   t.push( "sendinvoice"_n, { alice }, alice, bob, brm( 100 ), t.now(), "" );
+   t.push( "sendinvoice"_n, { alice }, alice, bob, brm( 200 ), t.now(), "" );
+   t.push( "sendinvoice"_n, { alice }, alice, carol, brm( 50 ), t.now(), "" );
+   CHECK_ASSERT( "cannot authorize self", t.push( "setallowance"_n, { bob }, bob, bob, brm( 250 ), uint32_t(0) ) );
+   CHECK_ASSERT( "cap must be positive", t.push( "setallowance"_n, { bob }, bob, alice, brm( 0 ), uint32_t(0) ) );
+   CHECK_ASSERT( "missing authority of bob", t.push( "setallowance"_n, { alice }, bob, alice, brm( 250 ), uint32_t(0) ) );
+   t.push( "setallowance"_n, { bob }, bob, alice, brm( 250 ), uint32_t(0) );
+
+   // the second invoice no longer fits the cap, carol approved nothing
+   CHECK_ASSERT( "missing authority of alice", t.push( "collectinvs"_n, { bob }, alice, uint32_t(0), uint32_t(10) ) );
+   t.push( "collectinvs"_n, { alice }, alice, uint32_t(0), uint32_t(10) );
+   CHECK( t.invoice( alice, FIRST_INVOICE_ID )->invoice_status == STATUS_PAID );
+   CHECK( t.invoice( alice, FIRST_INVOICE_ID )->payment_id == 1 );
+   CHECK( t.invoice( alice, FIRST_INVOICE_ID + 1 )->invoice_status == STATUS_OPEN );
+   CHECK( t.invoice( alice, FIRST_INVOICE_ID + 2 )->invoice_status == STATUS_OPEN );
+   CHECK( t.balance( bob ) == 10000000 - 100 && t.balance( alice ) == 10000000 + 100 );
+   CHECK( t.row_count( "cinvoices"_n, bob.value ) == 1 );
+   CHECK( t.allowance_of( bob, alice )->spent == brm( 100 ) );
+   CHECK_ASSERT( "Nothing to collect", t.push( "collectinvs"_n, { alice }, alice, uint32_t(0), uint32_t(10) ) );
+
+   // a one-off allowance does not renew
+   t.advance( 60 * 60 * 24 * 365 );
+   CHECK_ASSERT( "Nothing to collect", t.push( "collectinvs"_n, { alice }, alice, uint32_t(0), uint32_t(10) ) );
+
+   CHECK_ASSERT( "missing authority of bob", t.push( "delallowance"_n, { alice }, bob, alice ) );
+   t.push( "delallowance"_n, { bob }, bob, alice );
+   CHECK( !t.allowance_of( bob, alice ) );
+   CHECK_ASSERT( "no allowance for this merchant", t.push( "delallowance"_n, { bob }, bob, alice ) );
+}
+
+TEST( allowance_renews_each_period )
+{
+   brm_tester t;
+   const uint32_t HOUR = 60 * 60;
+   uint32_t start = t.now();
+   t.push( "setallowance"_n, { bob }, bob, alice, brm( 300 ), HOUR );
+   t.push( "sendinvoice"_n, { alice }, alice, bob, brm( 200 ), t.now(), "" );
+   t.push( "sendinvoice"_n, { alice }, alice, bob, brm( 200 ), t.now(), "" );
+   t.push( "collectinvs"_n, { alice }, alice, uint32_t(0), uint32_t(10) );
+   CHECK( t.invoice( alice, FIRST_INVOICE_ID + 1 )->invoice_status == STATUS_OPEN );
+   t.advance( HOUR - 1 );
+   CHECK_ASSERT( "Nothing to collect", t.push( "collectinvs"_n, { alice }, alice, uint32_t(0), uint32_t(10) ) );
+
+   // two and a half periods later spent starts over from the last boundary
+   t.advance( HOUR + HOUR / 2 + 1 );
+   t.push( "collectinvs"_n, { alice }, alice, uint32_t(0), uint32_t(10) );
+   CHECK( t.invoice( alice, FIRST_INVOICE_ID + 1 )->invoice_status == STATUS_PAID );
+   auto a = t.allowance_of( bob, alice );
+   CHECK( a->spent == brm( 200 ) && a->period_start == start + 2 * HOUR );
+   CHECK( t.balance( bob ) == 10000000 - 400 );
+
+   // new terms start a fresh period
+   t.push( "setallowance"_n, { bob }, bob, alice, brm( 500 ), HOUR );
+   a = t.allowance_of( bob, alice );
+   CHECK( a->spent == brm( 0 ) && a->period_start == t.now() && a->cap == brm( 500 ) );
+}
+
+TEST( recurring_bills_elapsed_periods )
+{
+   brm_tester t;
+   const uint32_t DAY = 60 * 60 * 24;
+   uint32_t first = t.now() + DAY;
+   CHECK_ASSERT( "period must be positive", t.push( "sendrecurring"_n, { alice }, alice, bob, brm( 100 ), uint32_t(0), first, "rent" ) );
+   t.push( "sendrecurring"_n, { alice }, alice, bob, brm( 100 ), DAY, first, "rent" );
+   CHECK( t.template_of( alice, FIRST_INVOICE_ID )->next_due == first );
+   CHECK( t.row_count( "cinvoices"_n, bob.value ) == 1 );
+   CHECK_ASSERT( "Nothing is due", t.push( "payrecurring"_n, { bob }, bob, FIRST_INVOICE_ID, uint32_t(10) ) );
+
+   // three periods have come due, max_periods lets bob pay two of them
+   t.advance( 3 * DAY + DAY / 2 );
+   t.push( "payrecurring"_n, { bob }, bob, FIRST_INVOICE_ID, uint32_t(2) );
+   CHECK( t.balance( bob ) == 10000000 - 200 && t.balance( alice ) == 10000000 + 200 );
+   CHECK( t.template_of( alice, FIRST_INVOICE_ID )->next_due == first + 2 * DAY );
+   t.push( "payrecurring"_n, { bob }, bob, FIRST_INVOICE_ID, uint32_t(10) );
+   CHECK( t.balance( bob ) == 10000000 - 300 );
+   auto r = t.template_of( alice, FIRST_INVOICE_ID );
+   CHECK( r->next_due == first + 3 * DAY && r->payment_id == 2 );
+   CHECK_ASSERT( "Nothing is due", t.push( "payrecurring"_n, { bob }, bob, FIRST_INVOICE_ID, uint32_t(10) ) );
+
+   CHECK_ASSERT( "missing authority of merchant or customer", t.push( "endrecurring"_n, { carol }, alice, FIRST_INVOICE_ID ) );
+   t.push( "endrecurring"_n, { bob }, alice, FIRST_INVOICE_ID );
+   CHECK( !t.template_of( alice, FIRST_INVOICE_ID ) );
+   CHECK( t.row_count( "cinvoices"_n, bob.value ) == 0 && t.row_count( "descrs"_n, self.value ) == 0 );
+   CHECK_ASSERT( "Account has no such invoice", t.push( "payrecurring"_n, { bob }, bob, FIRST_INVOICE_ID, uint32_t(10) ) );
+}
+
+TEST( recurring_dates_stay_in_range )
+{
+   brm_tester t;
+   const uint32_t DAY = 60 * 60 * 24;
+   CHECK_ASSERT( "period must not exceed a year", t.push( "sendrecurring"_n, { alice }, alice, bob, brm( 100 ), 367 * DAY, t.now(), "" ) );
+   CHECK_ASSERT( "first_due must not be in the past", t.push( "sendrecurring"_n, { alice }, alice, bob, brm( 100 ), DAY, uint32_t(0), "" ) );
+   CHECK_ASSERT( "first_due must not be in the past", t.push( "sendrecurring"_n, { alice }, alice, bob, brm( 100 ), DAY, t.now() - 1, "" ) );
+
+   // the period after the one paid would end past 2106
+   t.set_now( std::numeric_limits<uint32_t>::max() - 2 * DAY );
+   t.push( "sendrecurring"_n, { alice }, alice, bob, brm( 100 ), 366 * DAY, t.now(), "" );
+   CHECK_ASSERT( "next due date out of range", t.push( "payrecurring"_n, { bob }, bob, FIRST_INVOICE_ID, uint32_t(1) ) );
+   CHECK( t.template_of( alice, FIRST_INVOICE_ID )->next_due == t.now() && t.balance( bob ) == 10000000 );
+}
+
+TEST( collectrecur_settles_what_the_allowance_covers )
+{
+   brm_tester t;
+   const uint32_t DAY = 60 * 60 * 24;
+   uint32_t first = t.now();
+   t.push( "setallowance"_n, { bob }, bob, alice, brm( 250 ), 7 * DAY );
+   t.push( "sendrecurring"_n, { alice }, alice, bob, brm( 100 ), DAY, first, "" );
+   t.push( "sendrecurring"_n, { alice }, alice, carol, brm( 100 ), DAY, first, "" );
+
+   // four periods due, the cap covers two of them and carol approved nothing
+   t.advance( 3 * DAY );
+   CHECK_ASSERT( "missing authority of alice", t.push( "collectrecur"_n, { bob }, alice, uint32_t(0), uint32_t(10) ) );
+   t.push( "collectrecur"_n, { alice }, alice, uint32_t(0), uint32_t(10) );
+   CHECK( t.template_of( alice, FIRST_INVOICE_ID )->next_due == first + 2 * DAY );
+   CHECK( t.template_of( alice, FIRST_INVOICE_ID + 1 )->next_due == first );
+   CHECK( t.balance( bob ) == 10000000 - 200 && t.allowance_of( bob, alice )->spent == brm( 200 ) );
+   CHECK_ASSERT( "Nothing to collect", t.push( "collectrecur"_n, { alice }, alice, uint32_t(0), uint32_t(10) ) );
+
+   // the next allowance period covers two more, still leaving some behind
+   t.advance( 7 * DAY );
+   t.push( "collectrecur"_n, { alice }, alice, uint32_t(0), uint32_t(10) );
+   auto r = t.template_of( alice, FIRST_INVOICE_ID );
+   CHECK( r->next_due == first + 4 * DAY && r->payment_id == 2 );
+   auto a = t.allowance_of( bob, alice );
+   CHECK( a->spent == brm( 200 ) && a->period_start == first + 7 * DAY );
+   CHECK( t.balance( bob ) == 10000000 - 400 && t.balance( alice ) == 10000000 + 400 );
+}
+
+#endif
+
+int main( int argc, char** argv )
+{
+   return eosio_test::run_tests( argc, argv );
+}
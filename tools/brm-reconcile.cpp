@@ -0,0 +1,23 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ *
+ *  Offline BRM reconciliation, see brm-reconcile.hpp for the input. Per
+ *  account positions go to stdout as CSV, global totals and the supply
+ *  check to stderr. The exit status is 1 when supply does not match and
+ *  2 when the input cannot be read.
+ *
+ *     g++ -std=c++17 -O2 -pthread -Wno-attributes -I tests -I include -o brm-reconcile tools/brm-reconcile.cpp
+ *     brm-reconcile manifest [threads] > positions.csv
+ */
+
+#include "brm-reconcile.hpp"
+
+int main( int argc, char** argv ) {
+   if( argc < 2 ) {
+      fprintf( stderr, "usage: %s manifest [threads]\n", argv[0] );
+      return 2;
+   }
+   unsigned threads = argc > 2 ? static_cast<unsigned>( atoi( argv[2] ) ) : std::thread::hardware_concurrency();
+   return brm_reconcile::reconcile( argv[1], threads, stdout, stderr );
+}
@@ -0,0 +1,419 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ *
+ *  Offline BRM reconciliation over the contract tables as nodeos returns
+ *  them. Each table and scope is saved with get_table_rows and "json":false,
+ *  so rows come back as the packed hex stored by multi_index / singleton:
+ *
+ *     curl -s $NODE/v1/chain/get_table_rows -d '{"code":"eosio.token",
+ *          "table":"accounts","scope":"alice","json":false,"limit":1000}' > accounts.alice.json
+ *
+ *  (get_table_by_scope lists the scopes of a table). A manifest names the
+ *  saved responses, one "<table> <scope> <file>" per line, files relative
+ *  to the manifest; a table and scope may span several pages. Rows are
+ *  split across threads and unpacked into the contract's own row types
+ *  (accounts, stat, stakestate, stakebals, locks, minvoices), so the tool
+ *  is built against the contract header and the stub eosiolib in tests,
+ *  with the same -DBRM_* flags as the contract.
+ */
+#pragma once
+
+#include <eosio.token/eosio.token.hpp>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace brm_reconcile {
+
+   // the contract's row types, befriended by eosio::token
+   struct rows {
+      using account = eosio::token::account;
+      using currency_stats = eosio::token::currency_stats;
+#ifndef BRM_NO_STAKING
+      using stake_state = eosio::token::stake_state;
+      using stake_row = eosio::token::stake_row;
+      using lock_balance = eosio::token::lock_balance;
+#endif
+#ifndef BRM_NO_INVOICES
+      using utility_invoice = eosio::token::utility_invoice;
+#endif
+
+      static constexpr eosio::symbol BRM_SYMBOL = eosio::token::BRM_SYMBOL;
+
+#ifndef BRM_NO_INVOICES
+      // the status constants are members of the contract, not static
+      static uint8_t invoice_open() {
+         eosio::token contract( eosio::name(), eosio::name(), eosio::datastream<const char*>( nullptr, 0 ) );
+         return contract.BRM_INVOICE_STATUS_OPEN;
+      }
+#endif
+   };
+
+   // unpacks a whole row, false when it is short or has bytes left over
+   template<typename T>
+   bool unpack_row( const std::vector<char>& packed, T& row ) {
+      eosio::datastream<const char*> ds( packed.data(), packed.size() );
+      try {
+         ds >> row;
+      } catch( const eosio_test::assert_failure& ) {
+         return false;
+      }
+      return ds.remaining() == 0;
+   }
+
+   // one packed row and the table and scope it was read from
+   struct record {
+      uint64_t                   table;
+      uint64_t                   scope;
+      const std::vector<char>&   row;
+   };
+
+   // all amounts raw BRM units
+   struct position {
+      int64_t  balance = 0;
+      int64_t  staked = 0;
+      int64_t  escrow = 0;
+      int64_t  locked = 0;
+      int64_t  payable = 0;                  // open invoices sent to the account
+      int64_t  receivable = 0;               // open invoices sent by the account
+   };
+
+   struct totals {
+      int64_t  supply = 0;
+      int64_t  balances = 0;
+      int64_t  staked = 0;
+      int64_t  escrow = 0;
+      int64_t  locked = 0;
+      int64_t  unclaimed = 0;                // stakestate.unclaimed_tokens
+      int64_t  counter_staked = 0;           // stakestate.total_staked
+      uint64_t records = 0;
+      uint64_t skipped = 0;                  // other tables and symbols
+      uint64_t malformed = 0;
+   };
+
+   struct shard {
+      std::unordered_map<uint64_t, position> positions;
+      totals                                 sum;
+   };
+
+   inline void decode( const record& r, shard& out ) {
+      totals& sum = out.sum;
+      sum.records++;
+
+      switch( r.table ) {
+         case "accounts"_n.value: {
+            rows::account a;
+            if( !unpack_row( r.row, a ) ) break;
+            if( a.balance.symbol != rows::BRM_SYMBOL ) { sum.skipped++; return; }
+            out.positions[r.scope].balance += a.balance.amount;
+            sum.balances += a.balance.amount;
+            return;
+         }
+         case "stat"_n.value: {
+            rows::currency_stats st;
+            if( !unpack_row( r.row, st ) ) break;
+            if( st.supply.symbol != rows::BRM_SYMBOL ) { sum.skipped++; return; }
+            sum.supply += st.supply.amount;
+            return;
+         }
+#ifndef BRM_NO_STAKING
+         case "stakestate"_n.value: {
+            rows::stake_state ss;
+            if( !unpack_row( r.row, ss ) ) break;
+            sum.counter_staked += ss.total_staked;
+            sum.unclaimed += ss.unclaimed_tokens;
+            return;
+         }
+         case "stakebals"_n.value: {
+            rows::stake_row s;
+            if( !unpack_row( r.row, s ) ) break;
+            auto& p = out.positions[r.scope];
+            p.staked += s.staked;
+            p.escrow += s.escrow;
+            sum.staked += s.staked;
+            sum.escrow += s.escrow;
+            return;
+         }
+         case "locks"_n.value: {
+            rows::lock_balance l;
+            if( !unpack_row( r.row, l ) ) break;
+            out.positions[r.scope].locked += l.locked();
+            sum.locked += l.locked();
+            return;
+         }
+#endif
+#ifndef BRM_NO_INVOICES
+         case "minvoices"_n.value: {
+            static const uint8_t open = rows::invoice_open();
+            rows::utility_invoice inv;
+            if( !unpack_row( r.row, inv ) ) break;
+            if( inv.invoice_total.symbol != rows::BRM_SYMBOL || inv.invoice_status != open ) { sum.skipped++; return; }
+            out.positions[inv.from_account.value].receivable += inv.invoice_total.amount;
+            out.positions[inv.to_account.value].payable += inv.invoice_total.amount;
+            return;
+         }
+#endif
+         default:
+            sum.skipped++;
+            return;
+      }
+      sum.malformed++;
+   }
+
+   inline void merge( shard& into, shard& from ) {
+      for( auto& [owner, p] : from.positions ) {
+         auto& q = into.positions[owner];
+         q.balance += p.balance;
+         q.staked += p.staked;
+         q.escrow += p.escrow;
+         q.locked += p.locked;
+         q.payable += p.payable;
+         q.receivable += p.receivable;
+      }
+      from.positions.clear();
+      totals& a = into.sum;
+      const totals& b = from.sum;
+      a.supply += b.supply;
+      a.balances += b.balances;
+      a.staked += b.staked;
+      a.escrow += b.escrow;
+      a.locked += b.locked;
+      a.unclaimed += b.unclaimed;
+      a.counter_staked += b.counter_staked;
+      a.records += b.records;
+      a.skipped += b.skipped;
+      a.malformed += b.malformed;
+   }
+
+   // a memory mapped get_table_rows response, unmapped on destruction
+   struct mapped_file {
+      const char* data = nullptr;
+      size_t      size = 0;
+
+      mapped_file() = default;
+      mapped_file( const mapped_file& ) = delete;
+      mapped_file& operator=( const mapped_file& ) = delete;
+      ~mapped_file() {
+         if( data ) munmap( const_cast<char*>( data ), size );
+      }
+
+      bool open( const std::string& path ) {
+         int fd = ::open( path.c_str(), O_RDONLY );
+         struct stat st;
+         if( fd < 0 || fstat( fd, &st ) != 0 ) {
+            if( fd >= 0 ) close( fd );
+            return false;
+         }
+         size = static_cast<size_t>( st.st_size );
+         if( size > 0 ) {
+            void* map = mmap( nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+            if( map == MAP_FAILED ) {
+               close( fd );
+               return false;
+            }
+            madvise( map, size, MADV_SEQUENTIAL );
+            data = static_cast<const char*>( map );
+         }
+         close( fd );
+         return true;
+      }
+   };
+
+   // where one hex row sits in its mapped file
+   struct hex_row {
+      uint64_t    table;
+      uint64_t    scope;
+      const char* hex;
+      size_t      len;
+   };
+
+   // collects the strings of the "rows" array; false when there is no
+   // such array or it holds objects, i.e. the dump was taken with json:true
+   inline bool find_rows( const char* p, const char* end, uint64_t table, uint64_t scope,
+                          std::vector<hex_row>& out ) {
+      static const char key[] = "\"rows\"";
+      const char* k = std::search( p, end, key, key + sizeof( key ) - 1 );
+      if( k == end ) return false;
+      p = k + sizeof( key ) - 1;
+      while( p < end && ( isspace( static_cast<unsigned char>( *p ) ) || *p == ':' ) ) ++p;
+      if( p == end || *p++ != '[' ) return false;
+      while( p < end ) {
+         char c = *p;
+         if( isspace( static_cast<unsigned char>( c ) ) || c == ',' ) {
+            ++p;
+         } else if( c == ']' ) {
+            return true;
+         } else if( c == '"' ) {
+            const char* q = static_cast<const char*>( memchr( p + 1, '"', end - p - 1 ) );
+            if( !q ) return false;
+            out.push_back( hex_row{ table, scope, p + 1, static_cast<size_t>( q - p - 1 ) } );
+            p = q + 1;
+         } else {
+            return false;
+         }
+      }
+      return false;
+   }
+
+   // scopes are names, except stat's, which is the symbol code
+   inline uint64_t scope_value( const char* scope ) {
+      if( isupper( static_cast<unsigned char>( scope[0] ) ) ) {
+         return eosio::symbol_code( scope ).raw();
+      }
+      return eosio::name( scope ).value;
+   }
+
+   inline int hex_value( char c ) {
+      if( c >= '0' && c <= '9' ) return c - '0';
+      if( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+      if( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+      return -1;
+   }
+
+   inline bool from_hex( const char* hex, size_t len, std::vector<char>& out ) {
+      if( len % 2 ) return false;
+      out.resize( len / 2 );
+      for( size_t i = 0; i < out.size(); ++i ) {
+         int hi = hex_value( hex[2 * i] );
+         int lo = hex_value( hex[2 * i + 1] );
+         if( hi < 0 || lo < 0 ) return false;
+         out[i] = static_cast<char>( hi << 4 | lo );
+      }
+      return true;
+   }
+
+   /**
+    *  Reads every response named by the manifest, writes per account
+    *  positions to csv and the totals and supply check to log. Returns 0
+    *  when supply matches, 1 on a mismatch and 2 when the input cannot be read.
+    */
+   inline int reconcile( const char* manifest, unsigned threads, FILE* csv, FILE* log ) {
+      FILE* m = fopen( manifest, "r" );
+      if( !m ) {
+         fprintf( log, "%s: %s\n", manifest, strerror( errno ) );
+         return 2;
+      }
+      std::string dir = manifest;
+      size_t slash = dir.rfind( '/' );
+      dir = slash == std::string::npos ? std::string() : dir.substr( 0, slash + 1 );
+
+      std::vector<std::unique_ptr<mapped_file>> files;
+      std::vector<hex_row> found;
+      char line[4096];
+      unsigned lineno = 0;
+      while( fgets( line, sizeof( line ), m ) ) {
+         ++lineno;
+         char table[16], scope[16], path[4000];
+         const char* p = line;
+         while( isspace( static_cast<unsigned char>( *p ) ) ) ++p;
+         if( *p == '\0' || *p == '#' ) continue;
+         uint64_t table_key, scope_key;
+         try {
+            if( sscanf( p, "%15s %15s %3999s", table, scope, path ) != 3 ) {
+               throw eosio_test::assert_failure( "expected <table> <scope> <file>" );
+            }
+            table_key = eosio::name( table ).value;
+            scope_key = scope_value( scope );
+         } catch( const eosio_test::assert_failure& e ) {
+            fprintf( log, "%s:%u: %s\n", manifest, lineno, e.what() );
+            fclose( m );
+            return 2;
+         }
+         std::string file = path[0] == '/' ? std::string( path ) : dir + path;
+         files.emplace_back( new mapped_file );
+         auto& f = *files.back();
+         if( !f.open( file ) ) {
+            fprintf( log, "%s: %s\n", file.c_str(), strerror( errno ) );
+            fclose( m );
+            return 2;
+         }
+         if( !find_rows( f.data, f.data + f.size, table_key, scope_key, found ) ) {
+            fprintf( log, "%s: found are not hex, dump with json:false\n", file.c_str() );
+            fclose( m );
+            return 2;
+         }
+      }
+      fclose( m );
+
+      threads = std::max( threads, 1u );
+      threads = std::min<size_t>( threads, std::max<size_t>( found.size(), 1 ) );
+      std::vector<shard> shards( threads );
+      std::vector<std::thread> workers;
+      size_t per_thread = ( found.size() + threads - 1 ) / threads;
+      for( unsigned t = 0; t < threads; ++t ) {
+         workers.emplace_back( [&, t]() {
+            size_t first = std::min( found.size(), t * per_thread );
+            size_t last = std::min( found.size(), first + per_thread );
+            std::vector<char> buf;
+            for( size_t i = first; i < last; ++i ) {
+               const hex_row& h = found[i];
+               if( !from_hex( h.hex, h.len, buf ) ) {
+                  shards[t].sum.records++;
+                  shards[t].sum.malformed++;
+                  continue;
+               }
+               record r{ h.table, h.scope, buf };
+               decode( r, shards[t] );
+            }
+         });
+      }
+      for( auto& w : workers ) {
+         w.join();
+      }
+      for( unsigned t = 1; t < threads; ++t ) {
+         merge( shards[0], shards[t] );
+      }
+
+      auto& result = shards[0];
+      std::vector<uint64_t> owners;
+      owners.reserve( result.positions.size() );
+      for( const auto& entry : result.positions ) {
+         owners.push_back( entry.first );
+      }
+      std::sort( owners.begin(), owners.end() );
+
+      fprintf( csv, "owner,balance,staked,escrow,locked,payable,receivable\n" );
+      for( uint64_t owner : owners ) {
+         const auto& p = result.positions[owner];
+         fprintf( csv, "%s,%lld,%lld,%lld,%lld,%lld,%lld\n", eosio::name( owner ).to_string().c_str(),
+                  (long long)p.balance, (long long)p.staked, (long long)p.escrow,
+                  (long long)p.locked, (long long)p.payable, (long long)p.receivable );
+      }
+
+      // same identity as the on-chain audit: supply = balances + staked +
+      // locked + unclaimed rewards (escrow is part of unclaimed)
+      const totals& s = result.sum;
+      int64_t accounted = s.balances + s.staked + s.locked + s.unclaimed;
+      fprintf( log, "records %llu skipped %llu malformed %llu accounts %zu\n",
+               (unsigned long long)s.records, (unsigned long long)s.skipped,
+               (unsigned long long)s.malformed, owners.size() );
+      fprintf( log, "supply %lld balances %lld staked %lld locked %lld unclaimed %lld escrow %lld\n",
+               (long long)s.supply, (long long)s.balances, (long long)s.staked,
+               (long long)s.locked, (long long)s.unclaimed, (long long)s.escrow );
+      bool ok = accounted == s.supply && s.counter_staked == s.staked && s.malformed == 0;
+      if( s.counter_staked != s.staked ) {
+         fprintf( log, "stakestate.total_staked %lld does not match stake found %lld\n",
+                  (long long)s.counter_staked, (long long)s.staked );
+      }
+      fprintf( log, "%s: supply %lld, accounted %lld\n", ok ? "OK" : "MISMATCH",
+               (long long)s.supply, (long long)accounted );
+      return ok ? 0 : 1;
+   }
+
+} /// namespace brm_reconcile